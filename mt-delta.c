@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include <limits.h>
+#include "mt-sbuf.h"
+#include "mt-wqueue.h"
+#include "mt-delta.h"
+
+void mt_delta_init(struct mt_delta *self)
+{
+	memset(self, 0, sizeof(*self));
+	mt_delta_keyframe(self);
+}
+
+void mt_delta_free(struct mt_delta *self)
+{
+	free(self->s_col);
+	free(self->e_col);
+	memset(self, 0, sizeof(*self));
+}
+
+static void row_damage(struct mt_delta *self, mt_coord row,
+                       mt_coord s_col, mt_coord e_col)
+{
+	if (self->s_col[row] >= self->e_col[row]) {
+		self->s_col[row] = s_col;
+		self->e_col[row] = e_col;
+		return;
+	}
+
+	self->s_col[row] = MT_MIN(self->s_col[row], s_col);
+	self->e_col[row] = MT_MAX(self->e_col[row], e_col);
+}
+
+static void row_clean(struct mt_delta *self, mt_coord row)
+{
+	self->s_col[row] = 0;
+	self->e_col[row] = 0;
+}
+
+void mt_delta_damage(struct mt_delta *self, mt_coord s_col, mt_coord s_row,
+                     mt_coord e_col, mt_coord e_row)
+{
+	mt_coord row;
+
+	if (self->keyframe)
+		return;
+
+	self->dirty = 1;
+
+	/* Screen was resized */
+	if (e_row > self->rows) {
+		mt_delta_keyframe(self);
+		return;
+	}
+
+	for (row = MT_MAX(s_row, 0); row < e_row; row++)
+		row_damage(self, row, MT_MAX(s_col, 0), e_col);
+}
+
+void mt_delta_scroll(struct mt_delta *self, int lines)
+{
+	mt_coord row, rows = self->rows;
+	size_t moved;
+
+	if (self->keyframe)
+		return;
+
+	self->dirty = 1;
+
+	if (abs(lines) >= rows || abs(self->scroll + lines) >= rows) {
+		mt_delta_keyframe(self);
+		return;
+	}
+
+	self->scroll += lines;
+
+	moved = (rows - abs(lines)) * sizeof(mt_coord);
+
+	/* Damage moves with the content, rows that scrolled in are damaged */
+	if (lines > 0) {
+		memmove(self->s_col, self->s_col + lines, moved);
+		memmove(self->e_col, self->e_col + lines, moved);
+
+		for (row = rows - lines; row < rows; row++)
+			row_damage(self, row, 0, INT_MAX);
+	} else {
+		memmove(self->s_col - lines, self->s_col, moved);
+		memmove(self->e_col - lines, self->e_col, moved);
+
+		for (row = 0; row < -lines; row++) {
+			row_clean(self, row);
+			row_damage(self, row, 0, INT_MAX);
+		}
+	}
+}
+
+void mt_delta_cursor(struct mt_delta *self, mt_coord col, mt_coord row)
+{
+	if (self->keyframe)
+		return;
+
+	self->cursor = 1;
+
+	/* Cursor is drawn as a reversed cell */
+	mt_delta_damage(self, col, row, col + 1, row + 1);
+}
+
+static int put(struct mt_wqueue *out, const void *buf, size_t len)
+{
+	return mt_wqueue_add(out, buf, len);
+}
+
+static int put_u8(struct mt_wqueue *out, uint8_t val)
+{
+	return put(out, &val, 1);
+}
+
+static int put_u16(struct mt_wqueue *out, uint16_t val)
+{
+	uint8_t buf[2] = {val, val >> 8};
+
+	return put(out, buf, 2);
+}
+
+int mt_delta_hello(struct mt_wqueue *out)
+{
+	uint8_t buf[MT_DELTA_HELLO_SIZE] = {'M', 'T', 'D', 'P', MT_DELTA_VERSION};
+
+	return put(out, buf, sizeof(buf));
+}
+
+static uint8_t attr(const struct mt_char *c)
+{
+	return mt_char_fg_col(c) | mt_char_bg_col(c) << 3 |
+	       mt_char_bold(c) << 6 | mt_char_reverse(c) << 7;
+}
+
+static int same_attr(const struct mt_char *a, const struct mt_char *b)
+{
+	return attr(a) == attr(b);
+}
+
+static int put_run(struct mt_wqueue *out, const struct mt_char *cells,
+                   mt_coord len, int blank)
+{
+	char buf[256];
+	mt_coord i, n;
+	int ret;
+
+	ret = put_u16(out, len);
+	ret |= put_u8(out, attr(&cells[0]));
+
+	while (len) {
+		n = MT_MIN(len, (mt_coord)sizeof(buf));
+
+		for (i = 0; i < n; i++) {
+			char c = mt_char_c(&cells[blank ? 0 : i]);
+			buf[i] = c ? c : ' ';
+		}
+
+		ret |= put(out, buf, n);
+
+		if (!blank)
+			cells += n;
+
+		len -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * Cells with the same attributes are sent in a single run, blank rows are
+ * a single run of the blank character.
+ */
+static int put_row(struct mt_wqueue *out, struct mt_sbuf *sbuf, mt_coord row,
+                   mt_coord s_col, mt_coord e_col)
+{
+	const struct mt_char *cells;
+	mt_coord col, start;
+	uint16_t runs = 1;
+	int ret;
+
+	ret = put_u8(out, MT_DELTA_ROW);
+	ret |= put_u16(out, row);
+	ret |= put_u16(out, s_col);
+
+	if (mt_sbuf_row_blank(sbuf, row)) {
+		ret |= put_u16(out, 1);
+		return ret | put_run(out, mt_sbuf_row_blank_char(sbuf, row), e_col - s_col, 1);
+	}
+
+	cells = mt_sbuf_row(sbuf, row);
+
+	for (col = s_col + 1; col < e_col; col++) {
+		if (!same_attr(&cells[col], &cells[col - 1]))
+			runs++;
+	}
+
+	ret |= put_u16(out, runs);
+
+	for (start = s_col, col = s_col + 1; col <= e_col; col++) {
+		if (col < e_col && same_attr(&cells[col], &cells[start]))
+			continue;
+
+		ret |= put_run(out, &cells[start], col - start, 0);
+		start = col;
+	}
+
+	return ret;
+}
+
+static int resize(struct mt_delta *self, mt_coord rows)
+{
+	mt_coord *s_col, *e_col;
+
+	if (self->rows == rows)
+		return 0;
+
+	s_col = realloc(self->s_col, rows * sizeof(mt_coord));
+	if (!s_col)
+		return 1;
+
+	self->s_col = s_col;
+
+	e_col = realloc(self->e_col, rows * sizeof(mt_coord));
+	if (!e_col)
+		return 1;
+
+	self->e_col = e_col;
+	self->rows = rows;
+
+	return 0;
+}
+
+static void reset(struct mt_delta *self)
+{
+	mt_coord row;
+
+	for (row = 0; row < self->rows; row++)
+		row_clean(self, row);
+
+	self->scroll = 0;
+	self->keyframe = 0;
+	self->cursor = 0;
+	self->dirty = 0;
+}
+
+int mt_delta_encode(struct mt_delta *self, struct mt_sbuf *sbuf,
+                    struct mt_wqueue *out)
+{
+	size_t start = mt_wqueue_pending(out);
+	uint8_t *len;
+	uint32_t payload;
+	mt_coord row;
+	int ret;
+
+	if (self->rows != sbuf->rows)
+		mt_delta_keyframe(self);
+
+	if (self->keyframe) {
+		if (resize(self, sbuf->rows))
+			return 1;
+
+		for (row = 0; row < self->rows; row++) {
+			self->s_col[row] = 0;
+			self->e_col[row] = sbuf->cols;
+		}
+	}
+
+	/* Payload length is filled in once the frame is complete */
+	ret = put(out, "\0\0\0\0", 4);
+
+	if (self->keyframe) {
+		ret |= put_u8(out, MT_DELTA_KEYFRAME);
+		ret |= put_u16(out, sbuf->cols);
+		ret |= put_u16(out, sbuf->rows);
+	} else if (self->scroll) {
+		ret |= put_u8(out, MT_DELTA_SCROLL);
+		ret |= put_u16(out, (int16_t)self->scroll);
+	}
+
+	for (row = 0; row < self->rows; row++) {
+		mt_coord e_col = MT_MIN(self->e_col[row], sbuf->cols);
+
+		if (self->s_col[row] < e_col)
+			ret |= put_row(out, sbuf, row, self->s_col[row], e_col);
+	}
+
+	if (self->keyframe || self->cursor) {
+		ret |= put_u8(out, MT_DELTA_CURSOR);
+		ret |= put_u16(out, sbuf->cur_col);
+		ret |= put_u16(out, sbuf->cur_row);
+		ret |= put_u8(out, sbuf->cursor_hidden ? 0 : MT_DELTA_CURSOR_VISIBLE);
+	}
+
+	/* Drop the partial frame */
+	if (ret) {
+		out->len = out->off + start;
+		return 1;
+	}
+
+	len = (uint8_t *)out->buf + out->off + start;
+	payload = mt_wqueue_pending(out) - start - 4;
+
+	len[0] = payload;
+	len[1] = payload >> 8;
+	len[2] = payload >> 16;
+	len[3] = payload >> 24;
+
+	reset(self);
+
+	return 0;
+}
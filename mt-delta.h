@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_DELTA__
+#define MT_DELTA__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "mt-common.h"
+
+struct mt_sbuf;
+struct mt_wqueue;
+
+/*
+ * Screen delta protocol.
+ *
+ * A connection starts with a hello, four bytes "MTDP" followed by the version
+ * byte and three reserved bytes. Then the screen changes are sent as frames,
+ * each frame is a 32-bit payload length followed by the operations. All
+ * integers are little endian.
+ *
+ * KEYFRAME u16 cols, u16 rows
+ *   Screen was resized and cleared, all rows follow.
+ *
+ * SCROLL s16 lines
+ *   Screen content moved up by lines, down if negative, rows that scrolled in
+ *   are cleared.
+ *
+ * ROW u16 row, u16 col, u16 runs
+ *   Cells starting at col, each run is u16 len, u8 attr and len characters.
+ *   The attr has foreground color in bits 0-2, background in bits 3-5, bold in
+ *   bit 6 and reverse in bit 7. Empty cells are sent as spaces.
+ *
+ * CURSOR u16 col, u16 row, u8 flags
+ *   Cursor position, MT_DELTA_CURSOR_VISIBLE is set unless hidden.
+ */
+#define MT_DELTA_MAGIC "MTDP"
+#define MT_DELTA_VERSION 1
+#define MT_DELTA_HELLO_SIZE 8
+
+enum mt_delta_op {
+	MT_DELTA_KEYFRAME = 1,
+	MT_DELTA_SCROLL = 2,
+	MT_DELTA_ROW = 3,
+	MT_DELTA_CURSOR = 4,
+};
+
+#define MT_DELTA_CURSOR_VISIBLE 0x01
+
+/*
+ * Screen changes accumulated since the last encoded frame.
+ *
+ * The changes are coalesced, i.e. damaged cells are sent with the content
+ * they have when the frame is encoded, so a consumer that cannot keep up
+ * gets fewer and bigger frames.
+ */
+struct mt_delta {
+	mt_coord rows;
+	/* Damaged columns [s_col, e_col) per row, s_col >= e_col if clean */
+	mt_coord *s_col;
+	mt_coord *e_col;
+	int scroll;
+	uint8_t keyframe:1;
+	uint8_t cursor:1;
+	uint8_t dirty:1;
+};
+
+/*
+ * Initializes the delta, the first frame is a keyframe.
+ */
+void mt_delta_init(struct mt_delta *self);
+
+void mt_delta_free(struct mt_delta *self);
+
+/*
+ * Requests a keyframe, e.g. when the sbuf changed without notifying screens.
+ */
+static inline void mt_delta_keyframe(struct mt_delta *self)
+{
+	self->keyframe = 1;
+	self->dirty = 1;
+}
+
+/*
+ * Damaged rectangle, end coordinates are exclusive.
+ */
+void mt_delta_damage(struct mt_delta *self, mt_coord s_col, mt_coord s_row,
+                     mt_coord e_col, mt_coord e_row);
+
+void mt_delta_scroll(struct mt_delta *self, int lines);
+
+void mt_delta_cursor(struct mt_delta *self, mt_coord col, mt_coord row);
+
+static inline int mt_delta_pending(struct mt_delta *self)
+{
+	return self->dirty;
+}
+
+/*
+ * Writes protocol hello into the queue.
+ *
+ * Returns zero on success, non-zero on allocation failure.
+ */
+int mt_delta_hello(struct mt_wqueue *out);
+
+/*
+ * Encodes a frame with the accumulated changes and the current sbuf content
+ * into the queue and resets the delta.
+ *
+ * Returns zero on success, non-zero on allocation failure.
+ */
+int mt_delta_encode(struct mt_delta *self, struct mt_sbuf *sbuf,
+                    struct mt_wqueue *out);
+
+#endif /* MT_DELTA__ */
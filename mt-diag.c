@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <ctype.h>
+#include <time.h>
+#include "mt-diag.h"
+
+static const char *type_names[MT_DIAG_CNT] = {
+	[MT_DIAG_CSI] = "CSI",
+	[MT_DIAG_SGR] = "SGR",
+	[MT_DIAG_MODE] = "Mode",
+	[MT_DIAG_DEC_MODE] = "DEC mode",
+	[MT_DIAG_ESC] = "ESC",
+	[MT_DIAG_DCS] = "DCS",
+	[MT_DIAG_CTRL] = "Control char",
+	[MT_DIAG_CHAR] = "Invalid char",
+	[MT_DIAG_CHARSET] = "Charset",
+	[MT_DIAG_STATE] = "Invalid state",
+};
+
+const char *mt_diag_type_name(enum mt_diag_type type)
+{
+	if (type >= MT_DIAG_CNT)
+		return "???";
+
+	return type_names[type];
+}
+
+const struct mt_diag_sample *mt_diag_sample(struct mt_diag *self, unsigned int n)
+{
+	if (n >= MT_DIAG_SAMPLES || n >= self->sample_pos)
+		return NULL;
+
+	return &self->samples[(self->sample_pos - n - 1) % MT_DIAG_SAMPLES];
+}
+
+static uint64_t time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dump_sample(const struct mt_diag_sample *sample, FILE *f)
+{
+	fprintf(f, "  %s", mt_diag_type_name(sample->type));
+
+	if (sample->inter)
+		fprintf(f, " %c", sample->inter);
+
+	if (sample->par >= 0)
+		fprintf(f, " %i", sample->par);
+
+	if (isprint(sample->c))
+		fprintf(f, " '%c'", sample->c);
+	else
+		fprintf(f, " 0x%02x", sample->c);
+
+	fprintf(f, "\n");
+}
+
+void mt_diag_dump(struct mt_diag *self, FILE *f, int force)
+{
+	uint32_t new_samples = self->sample_pos - self->dump_pos;
+	uint64_t now;
+	unsigned int i;
+
+	if (!new_samples)
+		return;
+
+	now = time_ms();
+
+	if (!force && self->dump_ms && now - self->dump_ms < MT_DIAG_DUMP_MS)
+		return;
+
+	fprintf(f, "Unhandled input:\n");
+
+	for (i = 0; i < MT_DIAG_CNT; i++) {
+		if (self->cnt[i] == self->dump_cnt[i])
+			continue;
+
+		fprintf(f, "  %-14s %u (total %u)\n", mt_diag_type_name(i),
+		        self->cnt[i] - self->dump_cnt[i], self->cnt[i]);
+
+		self->dump_cnt[i] = self->cnt[i];
+	}
+
+	fprintf(f, "Recent samples:\n");
+
+	for (i = MT_MIN(new_samples, (uint32_t)MT_DIAG_SAMPLES); i > 0; i--)
+		dump_sample(mt_diag_sample(self, i - 1), f);
+
+	self->dump_pos = self->sample_pos;
+	self->dump_ms = now;
+}
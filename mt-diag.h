@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_DIAG__
+#define MT_DIAG__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "mt-common.h"
+
+/*
+ * Diagnostics for unhandled and invalid input.
+ *
+ * Applications may emit unsupported sequences on each redraw, so instead of
+ * printing we only count these by type and keep a ring of recent samples
+ * which is cheap enough to be done in the parser hot path.
+ */
+enum mt_diag_type {
+	/* Unhandled CSI sequence */
+	MT_DIAG_CSI,
+	/* Unhandled SGR parameter */
+	MT_DIAG_SGR,
+	/* Unhandled RM/SM mode */
+	MT_DIAG_MODE,
+	/* Unhandled DEC private mode */
+	MT_DIAG_DEC_MODE,
+	/* Unhandled ESC sequence */
+	MT_DIAG_ESC,
+	/* Device Control String, not implemented */
+	MT_DIAG_DCS,
+	/* Unhandled control character */
+	MT_DIAG_CTRL,
+	/* Invalid character for the current charset */
+	MT_DIAG_CHAR,
+	/* Invalid charset designation */
+	MT_DIAG_CHARSET,
+	/* Parser got into an invalid state */
+	MT_DIAG_STATE,
+	MT_DIAG_CNT,
+};
+
+struct mt_diag_sample {
+	uint8_t type;
+	/* Intermediate character or 0 */
+	char inter;
+	/* Final or offending character */
+	unsigned char c;
+	/* Parameter, -1 if there is none */
+	int par;
+};
+
+#define MT_DIAG_SAMPLES 32
+
+/* Minimal interval between two mt_diag_dump() outputs */
+#define MT_DIAG_DUMP_MS 10000
+
+struct mt_diag {
+	uint32_t cnt[MT_DIAG_CNT];
+
+	/* Ring of last samples, sample_pos counts all samples */
+	uint32_t sample_pos;
+	struct mt_diag_sample samples[MT_DIAG_SAMPLES];
+
+	/* State at the time of the last dump */
+	uint32_t dump_cnt[MT_DIAG_CNT];
+	uint32_t dump_pos;
+	uint64_t dump_ms;
+};
+
+/*
+ * Records an unhandled or invalid input.
+ */
+static inline void mt_diag(struct mt_diag *self, enum mt_diag_type type,
+                           char inter, unsigned char c, int par)
+{
+	struct mt_diag_sample *sample;
+
+	self->cnt[type]++;
+
+	sample = &self->samples[self->sample_pos++ % MT_DIAG_SAMPLES];
+
+	sample->type = type;
+	sample->inter = inter;
+	sample->c = c;
+	sample->par = par;
+}
+
+static inline uint32_t mt_diag_cnt(struct mt_diag *self, enum mt_diag_type type)
+{
+	return self->cnt[type];
+}
+
+/*
+ * Returns n-th most recent sample, NULL if there is no such sample.
+ */
+const struct mt_diag_sample *mt_diag_sample(struct mt_diag *self, unsigned int n);
+
+/*
+ * Returns diagnostic type name.
+ */
+const char *mt_diag_type_name(enum mt_diag_type type);
+
+/*
+ * Prints counters that changed since the last dump and new samples.
+ *
+ * Unless force is set nothing is printed when called sooner than
+ * MT_DIAG_DUMP_MS after the last output, so it's safe to call this in a
+ * loop.
+ */
+void mt_diag_dump(struct mt_diag *self, FILE *f, int force);
+
+#endif /* MT_DIAG__ */
@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include "mt-sbuf.h"
+#include "mt-hist.h"
+#include "mt-export.h"
+
+_Static_assert(sizeof(struct mt_char) == 2, "trim_len() expects 2 byte cells");
+
+struct out {
+	char *buf;
+	size_t size;
+	size_t len;
+
+	uint8_t sgr:1;
+	uint8_t sgr_used:1;
+	struct mt_char attr;
+};
+
+static void out_c(struct out *o, char c)
+{
+	if (o->len + 1 < o->size)
+		o->buf[o->len] = c;
+
+	o->len++;
+}
+
+static void out_s(struct out *o, const char *str)
+{
+	while (*str)
+		out_c(o, *(str++));
+}
+
+static int attr_eq(const struct mt_char *a, const struct mt_char *b)
+{
+	return a->bold == b->bold && a->reverse == b->reverse &&
+	       a->fg_col == b->fg_col && a->bg_col == b->bg_col;
+}
+
+static void out_sgr(struct out *o, const struct mt_char *c)
+{
+	char sgr[32];
+
+	if (o->sgr_used && attr_eq(&o->attr, c))
+		return;
+
+	snprintf(sgr, sizeof(sgr), "\e[0%s%s;3%u;4%um",
+	         c->bold ? ";1" : "", c->reverse ? ";7" : "",
+	         c->fg_col, c->bg_col);
+
+	out_s(o, sgr);
+
+	o->attr = *c;
+	o->sgr_used = 1;
+}
+
+static void out_cells(struct out *o, const struct mt_char *cells, size_t from, size_t to)
+{
+	size_t i;
+
+	if (!o->sgr) {
+		for (i = from; i < to; i++)
+			out_c(o, cells[i].c ? cells[i].c : ' ');
+		return;
+	}
+
+	for (i = from; i < to; i++) {
+		out_sgr(o, &cells[i]);
+		out_c(o, cells[i].c ? cells[i].c : ' ');
+	}
+}
+
+/*
+ * Returns length without trailing blanks, i.e. '\0' and ' ' characters. With
+ * sgr set blanks with a background color or reversed are kept, as in
+ * mt_char_empty(), so that e.g. status bars keep their colors.
+ *
+ * Four cells are checked at a time, a cell is blank if the character has no
+ * bits set but 0x20 and, with sgr, bg_col and reverse are not set.
+ */
+#define TRIM_MASK {.c = 0xdf}
+#define TRIM_MASK_SGR {.c = 0xdf, .reverse = 1, .bg_col = 7}
+
+static int trim_blank(const struct mt_char *c, int sgr)
+{
+	if (c->c & 0xdf)
+		return 0;
+
+	return !sgr || (!c->bg_col && !c->reverse);
+}
+
+static size_t trim_len(const struct mt_char *cells, size_t len, int sgr)
+{
+	static const struct mt_char mask_cells[2][4] = {
+		{TRIM_MASK, TRIM_MASK, TRIM_MASK, TRIM_MASK},
+		{TRIM_MASK_SGR, TRIM_MASK_SGR, TRIM_MASK_SGR, TRIM_MASK_SGR},
+	};
+	uint64_t mask, w;
+
+	memcpy(&mask, mask_cells[!!sgr], sizeof(mask));
+
+	while (len >= 4) {
+		memcpy(&w, cells + len - 4, sizeof(w));
+
+		if (w & mask)
+			break;
+
+		len -= 4;
+	}
+
+	while (len && trim_blank(&cells[len-1], sgr))
+		len--;
+
+	return len;
+}
+
+/*
+ * Iterates over logical lines in the history and on the screen.
+ */
+struct line_iter {
+	struct mt_sbuf *sbuf;
+	uint64_t line;
+	mt_coord row;
+	struct mt_char *tmp;
+};
+
+static int iter_init(struct line_iter *it, struct mt_sbuf *sbuf, uint64_t line)
+{
+	uint64_t cur = mt_sbuf_screen_line(sbuf);
+	size_t open_len = 0;
+
+	if (sbuf->hist.open)
+		mt_hist_line(&sbuf->hist, cur, &open_len);
+
+	it->sbuf = sbuf;
+	it->line = MT_MAX(line, sbuf->hist.first);
+	it->row = 0;
+	it->tmp = malloc((open_len + sbuf->rows * sbuf->cols) * sizeof(struct mt_char));
+	if (!it->tmp)
+		return 1;
+
+	while (cur < it->line && it->row < sbuf->rows) {
+		if (!mt_sbuf_row_wrapped(sbuf, it->row))
+			cur++;
+		it->row++;
+	}
+
+	return 0;
+}
+
+static const struct mt_char *iter_next(struct line_iter *it, size_t *len)
+{
+	struct mt_sbuf *sbuf = it->sbuf;
+	uint64_t cur = mt_sbuf_screen_line(sbuf);
+	const struct mt_char *open;
+	mt_coord row;
+	size_t l = 0;
+
+	if (it->line < cur)
+		return mt_hist_line(&sbuf->hist, it->line++, len);
+
+	if (it->row >= sbuf->rows)
+		return NULL;
+
+	if (it->line == cur && sbuf->hist.open) {
+		open = mt_hist_line(&sbuf->hist, cur, &l);
+		memcpy(it->tmp, open, l * sizeof(struct mt_char));
+	}
+
+	do {
+		row = it->row++;
+
+		if (!mt_sbuf_row_blank(sbuf, row)) {
+			memcpy(it->tmp + l, mt_sbuf_row(sbuf, row),
+			       sbuf->cols * sizeof(struct mt_char));
+			l += sbuf->cols;
+		}
+	} while (mt_sbuf_row_wrapped(sbuf, row) && it->row < sbuf->rows);
+
+	it->line++;
+
+	*len = l;
+	return it->tmp;
+}
+
+static void export_linear(struct out *o, const struct mt_sel *sel, uint64_t line,
+                          const struct mt_char *cells, size_t len)
+{
+	size_t from = line == sel->s_line ? sel->s_col : 0;
+	size_t to = len;
+
+	if (line == sel->e_line && sel->e_col < to)
+		to = sel->e_col + 1;
+
+	/* Blanks are trimmed at the end of the selected part */
+	if (from < to)
+		out_cells(o, cells, from, from + trim_len(cells + from, to - from, o->sgr));
+
+	if (line != sel->e_line)
+		out_c(o, '\n');
+}
+
+static void export_rect(struct out *o, const struct mt_sel *sel, uint64_t line,
+                        const struct mt_char *cells, size_t len, mt_coord cols)
+{
+	size_t s_x = sel->s_col % cols, e_x = sel->e_col % cols;
+	size_t x0 = MT_MIN(s_x, e_x), x1 = MT_MAX(s_x, e_x) + 1;
+	size_t r0 = 0, r1 = mt_hist_line_rows(len, cols) - 1;
+	size_t r;
+
+	if (line == sel->s_line)
+		r0 = sel->s_col / cols;
+
+	if (line == sel->e_line)
+		r1 = MT_MIN(r1, sel->e_col / cols);
+
+	for (r = r0; r <= r1; r++) {
+		size_t start = r * cols;
+		size_t row_len = start < len ? MT_MIN((size_t)cols, len - start) : 0;
+		size_t end = MT_MIN(x1, row_len);
+
+		if (x0 < end)
+			out_cells(o, cells + start, x0, x0 + trim_len(cells + start + x0, end - x0, o->sgr));
+
+		if (line != sel->e_line || r < r1)
+			out_c(o, '\n');
+	}
+}
+
+size_t mt_sbuf_export(struct mt_sbuf *self, const struct mt_sel *sel,
+                      enum mt_export_flags flags, char *buf, size_t buf_sz)
+{
+	struct out o = {
+		.buf = buf,
+		.size = buf_sz,
+		.sgr = !!(flags & MT_EXPORT_SGR),
+	};
+	const struct mt_char *cells;
+	struct line_iter it;
+	size_t len;
+
+	if (buf_sz)
+		buf[0] = 0;
+
+	if (sel->e_line < sel->s_line || iter_init(&it, self, sel->s_line))
+		return 0;
+
+	while (it.line <= sel->e_line && (cells = iter_next(&it, &len))) {
+		uint64_t line = it.line - 1;
+
+		if (sel->type == MT_SEL_RECT)
+			export_rect(&o, sel, line, cells, len, self->cols);
+		else
+			export_linear(&o, sel, line, cells, len);
+	}
+
+	if (o.sgr_used)
+		out_s(&o, "\e[0m");
+
+	if (buf_sz)
+		buf[MT_MIN(o.len, buf_sz - 1)] = 0;
+
+	free(it.tmp);
+
+	return o.len;
+}
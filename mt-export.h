@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_EXPORT__
+#define MT_EXPORT__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "mt-common.h"
+
+struct mt_sbuf;
+
+enum mt_sel_type {
+	/* Text from start to end, soft-wrapped rows are joined */
+	MT_SEL_LINEAR,
+	/* Rectangle of rows and columns at the current screen width */
+	MT_SEL_RECT,
+};
+
+/*
+ * Selection, positions are absolute line numbers and offsets into logical
+ * lines, i.e. the same as search matches, see mt_sbuf_screen_line().
+ *
+ * Both start and end position are inclusive. For a rectangular selection the
+ * positions are the corners of the rectangle.
+ */
+struct mt_sel {
+	enum mt_sel_type type;
+	uint64_t s_line;
+	size_t s_col;
+	uint64_t e_line;
+	size_t e_col;
+};
+
+enum mt_export_flags {
+	/* Emit SGR escape sequences to preserve colors and attributes */
+	MT_EXPORT_SGR = 0x01,
+};
+
+/*
+ * Writes selected text from the history and the screen into buf.
+ *
+ * Trailing blanks are trimmed on each line, lines are separated by '\n'.
+ *
+ * Works like snprintf(), the output is always NULL terminated unless buf_sz
+ * is zero and the return value is the length of the whole text without the
+ * terminating NULL, hence if the return value is >= buf_sz the output was
+ * truncated.
+ */
+size_t mt_sbuf_export(struct mt_sbuf *self, const struct mt_sel *sel,
+                      enum mt_export_flags flags, char *buf, size_t buf_sz);
+
+#endif /* MT_EXPORT__ */
@@ -0,0 +1,798 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mt-sbuf.h"
+#include "mt-hist.h"
+
+static struct mt_hist_blk *blk_alloc(uint64_t first)
+{
+	struct mt_hist_blk *blk;
+
+	blk = malloc(sizeof(struct mt_hist_blk));
+	if (!blk)
+		return NULL;
+
+	memset(blk, 0, sizeof(*blk));
+
+	blk->first = first;
+	blk->refs = 1;
+	blk->line_size = 64;
+	blk->line_off = malloc((blk->line_size + 1) * sizeof(uint32_t));
+	if (!blk->line_off) {
+		free(blk);
+		return NULL;
+	}
+
+	blk->line_off[0] = 0;
+
+	return blk;
+}
+
+void mt_hist_map_put(struct mt_hist_map *map)
+{
+	if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	munmap(map->addr, map->size);
+	free(map);
+}
+
+static void blk_free(struct mt_hist_blk *blk)
+{
+	if (blk->map) {
+		mt_hist_map_put(blk->map);
+	} else {
+		free(blk->cells);
+		free(blk->line_off);
+		free(blk->idx);
+	}
+
+	free(blk);
+}
+
+void mt_hist_blk_put(struct mt_hist_blk *blk)
+{
+	if (!__atomic_sub_fetch(&blk->refs, 1, __ATOMIC_ACQ_REL))
+		blk_free(blk);
+}
+
+static unsigned char idx_char(const struct mt_char *c)
+{
+	return c->c ? tolower(c->c) : ' ';
+}
+
+/*
+ * Block is full, no more lines will be added, build the trigram index.
+ */
+static void blk_seal(struct mt_hist_blk *blk)
+{
+	uint32_t i, j;
+
+	blk->sealed = 1;
+
+	/* Block without the index is always searched */
+	blk->idx = calloc(1, MT_HIST_IDX_SIZE);
+	if (!blk->idx)
+		return;
+
+	for (i = 0; i < blk->line_cnt; i++) {
+		const struct mt_char *line = blk->cells + blk->line_off[i];
+		uint32_t len = blk->line_off[i+1] - blk->line_off[i];
+
+		for (j = 2; j < len; j++) {
+			unsigned int t = mt_hist_trigram(idx_char(&line[j-2]),
+			                                 idx_char(&line[j-1]),
+			                                 idx_char(&line[j]));
+
+			blk->idx[t/64] |= 1ull<<(t%64);
+		}
+	}
+}
+
+struct mt_hist_spill {
+	int fd;
+	/* Memory used by sealed blocks that were not spilled yet */
+	size_t mem_cap;
+	size_t mem_used;
+	/* Chunk blocks are written to, write offset in the file */
+	struct mt_hist_map *chunk;
+	uint64_t chunk_off;
+	uint64_t off;
+	/* Number of oldest blocks known to be spilled */
+	size_t spilled;
+};
+
+static size_t blk_mem(struct mt_hist_blk *blk)
+{
+	return blk->cells_size * sizeof(struct mt_char) +
+	       (blk->line_size + 1) * sizeof(uint32_t) +
+	       (blk->idx ? MT_HIST_IDX_SIZE : 0);
+}
+
+/*
+ * Block is dropped from the history.
+ */
+static void blk_drop(struct mt_hist *self, struct mt_hist_blk *blk)
+{
+	if (self->spill && blk->sealed && !blk->map)
+		self->spill->mem_used -= blk_mem(blk);
+
+	mt_hist_blk_put(blk);
+}
+
+void mt_hist_free(struct mt_hist *self)
+{
+	size_t i;
+
+	for (i = 0; i < self->blk_cnt; i++)
+		blk_drop(self, self->blks[i]);
+
+	if (self->spill)
+		self->spill->spilled = 0;
+
+	free(self->blks);
+
+	self->blks = NULL;
+	self->blk_cnt = 0;
+	self->blk_size = 0;
+	self->first += self->lines;
+	self->lines = 0;
+	self->open = 0;
+	self->rcache.cols = 0;
+}
+
+/*
+ * Drops oldest blocks once the rest of the history is over the limit.
+ */
+static void drop_blks(struct mt_hist *self)
+{
+	size_t drop = 0;
+
+	while (self->blk_cnt - drop > 1) {
+		struct mt_hist_blk *blk = self->blks[drop];
+
+		if (self->lines - blk->line_cnt < self->max_lines)
+			break;
+
+		self->lines -= blk->line_cnt;
+		self->first += blk->line_cnt;
+		blk_drop(self, blk);
+		drop++;
+	}
+
+	if (!drop)
+		return;
+
+	if (self->spill)
+		self->spill->spilled -= MT_MIN(drop, self->spill->spilled);
+
+	self->blk_cnt -= drop;
+	memmove(self->blks, self->blks + drop, self->blk_cnt * sizeof(struct mt_hist_blk *));
+}
+
+void mt_hist_set_limit(struct mt_hist *self, size_t max_lines)
+{
+	self->max_lines = max_lines;
+
+	if (!max_lines) {
+		mt_hist_free(self);
+		return;
+	}
+
+	drop_blks(self);
+	self->rcache.cols = 0;
+}
+
+static int blks_reserve(struct mt_hist *self)
+{
+	size_t blk_size = MT_MAX(2 * self->blk_size, (size_t)16);
+	struct mt_hist_blk **blks;
+
+	if (self->blk_cnt < self->blk_size)
+		return 0;
+
+	blks = realloc(self->blks, blk_size * sizeof(struct mt_hist_blk *));
+	if (!blks)
+		return 1;
+
+	self->blks = blks;
+	self->blk_size = blk_size;
+
+	return 0;
+}
+
+static uint64_t spill_align(uint64_t off)
+{
+	return (off + 7) & ~(uint64_t)7;
+}
+
+static int chunk_new(struct mt_hist_spill *spill, uint64_t off)
+{
+	struct mt_hist_map *chunk;
+
+	chunk = malloc(sizeof(*chunk));
+	if (!chunk)
+		return 1;
+
+	/* File is sparse, only the written part takes space */
+	if (ftruncate(spill->fd, off + MT_HIST_SPILL_CHUNK))
+		goto err;
+
+	chunk->addr = mmap(NULL, MT_HIST_SPILL_CHUNK, PROT_READ, MAP_SHARED, spill->fd, off);
+	if (chunk->addr == MAP_FAILED)
+		goto err;
+
+	chunk->size = MT_HIST_SPILL_CHUNK;
+	chunk->refs = 1;
+
+	if (spill->chunk)
+		mt_hist_map_put(spill->chunk);
+
+	spill->chunk = chunk;
+	spill->chunk_off = off;
+	spill->off = off;
+
+	return 0;
+err:
+	free(chunk);
+	return 1;
+}
+
+static int write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret <= 0)
+			return 1;
+
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the block into the file and points it into the chunk mapping, line
+ * offsets, cells and the index are stored next to each other.
+ */
+static int blk_spill(struct mt_hist_spill *spill, struct mt_hist_blk *blk)
+{
+	size_t off_size = spill_align((blk->line_cnt + 1) * sizeof(uint32_t));
+	size_t idx_off = spill_align(off_size + blk->cells_used * sizeof(struct mt_char));
+	size_t size = idx_off + (blk->idx ? MT_HIST_IDX_SIZE : 0);
+	char *addr;
+
+	/* Huge lines stay in memory */
+	if (size > MT_HIST_SPILL_CHUNK)
+		return 1;
+
+	if (!spill->chunk || spill->off + size > spill->chunk_off + MT_HIST_SPILL_CHUNK) {
+		uint64_t off = spill->chunk ? spill->chunk_off + MT_HIST_SPILL_CHUNK : 0;
+
+		if (chunk_new(spill, off))
+			return 1;
+	}
+
+	if (write_at(spill->fd, blk->line_off, (blk->line_cnt + 1) * sizeof(uint32_t), spill->off) ||
+	    write_at(spill->fd, blk->cells, blk->cells_used * sizeof(struct mt_char), spill->off + off_size))
+		return 1;
+
+	if (blk->idx && write_at(spill->fd, blk->idx, MT_HIST_IDX_SIZE, spill->off + idx_off))
+		return 1;
+
+	addr = (char *)spill->chunk->addr + (spill->off - spill->chunk_off);
+
+	spill->mem_used -= blk_mem(blk);
+	spill->off = spill_align(spill->off + size);
+
+	free(blk->line_off);
+	free(blk->cells);
+
+	if (blk->idx) {
+		free(blk->idx);
+		blk->idx = (uint64_t *)(addr + idx_off);
+	}
+
+	blk->line_off = (uint32_t *)addr;
+	blk->cells = (struct mt_char *)(addr + off_size);
+	blk->line_size = blk->line_cnt;
+	blk->cells_size = blk->cells_used;
+	blk->map = spill->chunk;
+	mt_hist_map_get(blk->map);
+
+	return 0;
+}
+
+/*
+ * Spills oldest sealed blocks until we get under the memory cap.
+ */
+static void spill_blks(struct mt_hist *self)
+{
+	struct mt_hist_spill *spill = self->spill;
+	size_t i;
+	int prefix = 1;
+
+	/* Last block is still being filled */
+	for (i = spill->spilled; i + 1 < self->blk_cnt; i++) {
+		struct mt_hist_blk *blk = self->blks[i];
+
+		if (spill->mem_used <= spill->mem_cap)
+			break;
+
+		/*
+		 * References are taken by searches on this thread, a block that is
+		 * being searched is retried next time.
+		 */
+		if (!blk->map &&
+		    (!blk->sealed || __atomic_load_n(&blk->refs, __ATOMIC_ACQUIRE) > 1 ||
+		     blk_spill(spill, blk))) {
+			prefix = 0;
+			continue;
+		}
+
+		if (prefix)
+			spill->spilled = i + 1;
+	}
+}
+
+static int spill_open(const char *dir)
+{
+	char *path;
+	int fd;
+
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+		return fd;
+
+	/* Filesystems without O_TMPFILE */
+	path = malloc(strlen(dir) + 20);
+	if (!path)
+		return -1;
+
+	sprintf(path, "%s/mterm-hist-XXXXXX", dir);
+
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(path);
+
+	free(path);
+
+	return fd;
+}
+
+static void spill_free(struct mt_hist_spill *spill)
+{
+	if (spill->chunk)
+		mt_hist_map_put(spill->chunk);
+
+	/* The file is removed once spilled blocks are dropped */
+	close(spill->fd);
+	free(spill);
+}
+
+int mt_hist_set_spill(struct mt_hist *self, const char *dir, size_t mem_cap)
+{
+	struct mt_hist_spill *spill = self->spill;
+	size_t i;
+
+	if (!dir) {
+		if (spill)
+			spill_free(spill);
+
+		self->spill = NULL;
+		return 0;
+	}
+
+	if (!spill) {
+		spill = calloc(1, sizeof(*spill));
+		if (!spill)
+			return 1;
+
+		spill->fd = spill_open(dir);
+		if (spill->fd < 0) {
+			free(spill);
+			return 1;
+		}
+
+		for (i = 0; i < self->blk_cnt; i++) {
+			if (self->blks[i]->sealed && !self->blks[i]->map)
+				spill->mem_used += blk_mem(self->blks[i]);
+		}
+
+		self->spill = spill;
+	}
+
+	spill->mem_cap = mem_cap;
+	spill_blks(self);
+
+	return 0;
+}
+
+/*
+ * Returns block to start a new line in.
+ */
+static struct mt_hist_blk *line_blk(struct mt_hist *self)
+{
+	struct mt_hist_blk *blk = NULL, *prev;
+
+	if (self->blk_cnt)
+		blk = self->blks[self->blk_cnt - 1];
+
+	if (blk && !blk->sealed && blk->cells_used < MT_HIST_BLK_CELLS)
+		return blk;
+
+	if (blks_reserve(self))
+		return NULL;
+
+	blk = blk_alloc(self->first + self->lines);
+	if (!blk)
+		return NULL;
+
+	prev = self->blk_cnt ? self->blks[self->blk_cnt - 1] : NULL;
+
+	if (prev && !prev->sealed) {
+		blk_seal(prev);
+
+		if (self->spill)
+			self->spill->mem_used += blk_mem(prev);
+	}
+
+	self->blks[self->blk_cnt++] = blk;
+
+	if (self->spill)
+		spill_blks(self);
+
+	return blk;
+}
+
+static int blk_new_line(struct mt_hist_blk *blk)
+{
+	if (blk->line_cnt >= blk->line_size) {
+		uint32_t line_size = 2 * blk->line_size;
+		uint32_t *line_off;
+
+		line_off = realloc(blk->line_off, (line_size + 1) * sizeof(uint32_t));
+		if (!line_off)
+			return 1;
+
+		blk->line_off = line_off;
+		blk->line_size = line_size;
+	}
+
+	blk->line_cnt++;
+	blk->line_off[blk->line_cnt] = blk->cells_used;
+
+	return 0;
+}
+
+static int blk_append(struct mt_hist_blk *blk, const struct mt_char *cells, size_t len)
+{
+	if (blk->cells_used + len > blk->cells_size) {
+		size_t cells_size = MT_MAX(2 * (size_t)blk->cells_size, blk->cells_used + len);
+		struct mt_char *new_cells;
+
+		cells_size = MT_MAX(cells_size, (size_t)256);
+
+		new_cells = realloc(blk->cells, cells_size * sizeof(struct mt_char));
+		if (!new_cells)
+			return 1;
+
+		blk->cells = new_cells;
+		blk->cells_size = cells_size;
+	}
+
+	memcpy(blk->cells + blk->cells_used, cells, len * sizeof(struct mt_char));
+	blk->cells_used += len;
+	blk->line_off[blk->line_cnt] = blk->cells_used;
+
+	return 0;
+}
+
+/*
+ * Copies a block so that lines can be appended to it.
+ */
+static struct mt_hist_blk *blk_copy(const struct mt_hist_blk *src)
+{
+	struct mt_hist_blk *blk = blk_alloc(src->first);
+	uint32_t line_size, *line_off;
+
+	if (!blk)
+		return NULL;
+
+	line_size = MT_MAX(src->line_cnt, blk->line_size);
+
+	line_off = realloc(blk->line_off, (line_size + 1) * sizeof(uint32_t));
+	if (!line_off)
+		goto err;
+
+	blk->line_off = line_off;
+	blk->line_size = line_size;
+	blk->line_cnt = src->line_cnt;
+
+	if (blk_append(blk, src->cells, src->cells_used))
+		goto err;
+
+	memcpy(blk->line_off, src->line_off, (src->line_cnt + 1) * sizeof(uint32_t));
+
+	return blk;
+err:
+	blk_free(blk);
+	return NULL;
+}
+
+int mt_hist_restore_blk(struct mt_hist *self, struct mt_hist_map *map,
+                        const struct mt_hist_blk *src)
+{
+	struct mt_hist_blk *blk;
+
+	if (blks_reserve(self))
+		return 1;
+
+	if (src->sealed) {
+		blk = malloc(sizeof(struct mt_hist_blk));
+		if (!blk)
+			return 1;
+
+		*blk = *src;
+		blk->refs = 1;
+		blk->line_size = src->line_cnt;
+		blk->cells_size = src->cells_used;
+		blk->map = map;
+		mt_hist_map_get(map);
+	} else {
+		blk = blk_copy(src);
+		if (!blk)
+			return 1;
+	}
+
+	if (!self->blk_cnt)
+		self->first = blk->first;
+
+	self->blks[self->blk_cnt++] = blk;
+	self->lines += blk->line_cnt;
+	self->rcache.cols = 0;
+
+	return 0;
+}
+
+int mt_hist_push(struct mt_hist *self, const struct mt_char *cells, size_t len,
+                 uint8_t wrapped)
+{
+	struct mt_hist_blk *blk;
+
+	if (!self->max_lines)
+		return 0;
+
+	if (!wrapped) {
+		while (len && mt_char_empty(&cells[len - 1]))
+			len--;
+	}
+
+	self->rcache.cols = 0;
+
+	if (self->open) {
+		blk = self->blks[self->blk_cnt - 1];
+	} else {
+		blk = line_blk(self);
+		if (!blk || blk_new_line(blk))
+			return 1;
+
+		self->lines++;
+	}
+
+	self->open = !!wrapped;
+
+	if (blk_append(blk, cells, len))
+		return 1;
+
+	drop_blks(self);
+
+	return 0;
+}
+
+struct mt_char *mt_hist_pop_open(struct mt_hist *self, size_t *len)
+{
+	struct mt_hist_blk *blk;
+	struct mt_char *ret;
+	uint32_t off;
+	size_t l;
+
+	if (!self->open)
+		return NULL;
+
+	blk = self->blks[self->blk_cnt - 1];
+	off = blk->line_off[blk->line_cnt - 1];
+	l = blk->cells_used - off;
+
+	ret = malloc(MT_MAX(l, (size_t)1) * sizeof(struct mt_char));
+	if (!ret)
+		return NULL;
+
+	memcpy(ret, blk->cells + off, l * sizeof(struct mt_char));
+
+	blk->cells_used = off;
+	blk->line_cnt--;
+
+	if (!blk->line_cnt) {
+		mt_hist_blk_put(blk);
+		self->blk_cnt--;
+	}
+
+	self->lines--;
+	self->open = 0;
+	self->rcache.cols = 0;
+
+	*len = l;
+	return ret;
+}
+
+static size_t line_to_blk(struct mt_hist *self, uint64_t line)
+{
+	size_t l = 0, r = self->blk_cnt;
+
+	while (r - l > 1) {
+		size_t mid = (l + r) / 2;
+
+		if (self->blks[mid]->first <= line)
+			l = mid;
+		else
+			r = mid;
+	}
+
+	return l;
+}
+
+/* Page faults map up to this much of surrounding cached pages */
+#define FAULT_AROUND (64 << 10)
+
+/*
+ * Line offsets and cells of mapped blocks are next to each other, spilled
+ * blocks have the index right after the cells.
+ */
+static void blk_range(struct mt_hist_blk *blk, uintptr_t *start, uintptr_t *end)
+{
+	uintptr_t page = getpagesize();
+
+	*start = (uintptr_t)blk->line_off & ~(page - 1);
+	*end = (uintptr_t)(blk->cells + blk->cells_used);
+}
+
+void mt_hist_blk_unmap(struct mt_hist_blk *blk)
+{
+	uintptr_t start, end, map_start, map_end;
+
+	if (!blk->map)
+		return;
+
+	blk_range(blk, &start, &end);
+
+	/* Neighbourhood was mapped by the faults as well */
+	map_start = (uintptr_t)blk->map->addr;
+	map_end = map_start + blk->map->size;
+
+	start -= MT_MIN(start - map_start, (uintptr_t)FAULT_AROUND);
+	end = MT_MIN(end + FAULT_AROUND, map_end);
+
+	madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+static void blk_willneed(struct mt_hist_blk *blk)
+{
+	uintptr_t start, end;
+
+	blk_range(blk, &start, &end);
+
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+/*
+ * History is viewed from the newest line back, once we get into another
+ * mapped block the older blocks are read ahead. The previous window is
+ * unmapped, the pages stay in the page cache but do not count into RSS.
+ */
+static void read_ahead(struct mt_hist *self, size_t idx)
+{
+	struct mt_hist_blk *blk = self->blks[idx];
+	size_t i, old;
+
+	if (!blk->map || blk->first == self->ra_first)
+		return;
+
+	if (self->ra_first >= self->first && self->ra_first < self->first + self->lines) {
+		old = line_to_blk(self, self->ra_first);
+
+		for (i = old - MT_MIN(old, (size_t)MT_HIST_READAHEAD); i <= old; i++)
+			mt_hist_blk_unmap(self->blks[i]);
+	}
+
+	for (i = idx - MT_MIN(idx, (size_t)MT_HIST_READAHEAD); i <= idx; i++) {
+		if (self->blks[i]->map)
+			blk_willneed(self->blks[i]);
+	}
+
+	self->ra_first = blk->first;
+}
+
+const struct mt_char *mt_hist_line(struct mt_hist *self, uint64_t line, size_t *len)
+{
+	struct mt_hist_blk *blk;
+	size_t idx;
+	uint32_t i;
+
+	if (line < self->first || line >= self->first + self->lines)
+		return NULL;
+
+	idx = line_to_blk(self, line);
+	blk = self->blks[idx];
+
+	read_ahead(self, idx);
+
+	i = line - blk->first;
+
+	*len = blk->line_off[i + 1] - blk->line_off[i];
+
+	return blk->cells + blk->line_off[i];
+}
+
+const struct mt_char *mt_hist_row(struct mt_hist *self, mt_coord cols,
+                                  size_t n, size_t *len)
+{
+	const struct mt_char *cells;
+	uint64_t line;
+	size_t base, l, r, start;
+
+	if (!self->lines)
+		return NULL;
+
+	/* base is the number of rows below the last row of the line */
+	if (self->rcache.cols == cols) {
+		line = self->rcache.line;
+		base = self->rcache.n;
+	} else {
+		line = self->first + self->lines - 1;
+		base = 0;
+	}
+
+	while (n < base) {
+		line++;
+		mt_hist_line(self, line, &l);
+		base -= mt_hist_line_rows(l, cols);
+	}
+
+	for (;;) {
+		cells = mt_hist_line(self, line, &l);
+		r = mt_hist_line_rows(l, cols);
+
+		if (n < base + r)
+			break;
+
+		if (line == self->first)
+			return NULL;
+
+		base += r;
+		line--;
+	}
+
+	self->rcache.cols = cols;
+	self->rcache.line = line;
+	self->rcache.n = base;
+
+	start = (r - 1 - (n - base)) * cols;
+
+	*len = start < l ? MT_MIN((size_t)cols, l - start) : 0;
+
+	return cells + start;
+}
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_HIST__
+#define MT_HIST__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "mt-common.h"
+
+struct mt_char;
+
+#define MT_HIST_IDX_BITS 4096
+#define MT_HIST_IDX_SIZE (MT_HIST_IDX_BITS/8)
+
+/*
+ * Read-only mapping sealed blocks may point into, e.g. a restored snapshot.
+ */
+struct mt_hist_map {
+	void *addr;
+	size_t size;
+	uint32_t refs;
+};
+
+static inline void mt_hist_map_get(struct mt_hist_map *map)
+{
+	__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops a reference, the mapping is unmapped when last reference is dropped.
+ */
+void mt_hist_map_put(struct mt_hist_map *map);
+
+/*
+ * Scrollback history.
+ *
+ * Rows that scroll out of the screen are stored as logical lines, i.e. rows
+ * joined by soft-wraps, packed into blocks. Since lines are stored unwrapped
+ * the history is never reflowed on resize, rows for the current width are
+ * computed on access.
+ *
+ * Lines are numbered by absolute line numbers that do not change when oldest
+ * blocks are dropped.
+ */
+struct mt_hist_blk {
+	/* Absolute number of the first line in the block */
+	uint64_t first;
+
+	/* Sealed blocks are shared with search workers */
+	uint32_t refs;
+	uint8_t sealed:1;
+
+	/*
+	 * Bitmap of hashed lowercase trigrams, built when block is sealed,
+	 * used to skip blocks that cannot match. NULL if allocation failed.
+	 */
+	uint64_t *idx;
+
+	/* line_cnt + 1 offsets into cells */
+	uint32_t line_cnt;
+	uint32_t line_size;
+	uint32_t *line_off;
+
+	uint32_t cells_used;
+	uint32_t cells_size;
+	struct mt_char *cells;
+
+	/* Set if line_off and cells point into a mapping */
+	struct mt_hist_map *map;
+};
+
+static inline unsigned int mt_hist_trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+	uint32_t t = (a<<16) | (b<<8) | c;
+
+	return (t * 2654435761u) >> (32 - 12);
+}
+
+/*
+ * Returns non-zero if the block may contain the trigram.
+ */
+static inline int mt_hist_blk_idx_has(struct mt_hist_blk *blk, unsigned int trigram)
+{
+	if (!blk->idx)
+		return 1;
+
+	return !!(blk->idx[trigram/64] & (1ull<<(trigram%64)));
+}
+
+static inline void mt_hist_blk_get(struct mt_hist_blk *blk)
+{
+	__atomic_add_fetch(&blk->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops a reference, block is freed when last reference is dropped.
+ */
+void mt_hist_blk_put(struct mt_hist_blk *blk);
+
+/*
+ * Unmaps pages of a block that points into a mapping once it was read, the
+ * data stay in the page cache but do not count into RSS.
+ */
+void mt_hist_blk_unmap(struct mt_hist_blk *blk);
+
+#define MT_HIST_BLK_CELLS 16384
+#define MT_HIST_LINES 10000
+
+/* Spill file is mapped in chunks of this size */
+#define MT_HIST_SPILL_CHUNK (64 << 20)
+/* Number of older mapped blocks read ahead when history is scrolled back */
+#define MT_HIST_READAHEAD 4
+
+struct mt_hist_spill;
+
+struct mt_hist {
+	/* Absolute number of the first line */
+	uint64_t first;
+	/* Number of lines */
+	size_t lines;
+	/* Lines are dropped in blocks once we get over the limit */
+	size_t max_lines;
+
+	/* Last line continues on the screen */
+	uint8_t open:1;
+
+	size_t blk_cnt;
+	size_t blk_size;
+	struct mt_hist_blk **blks;
+
+	/* Sealed blocks are moved to a file, see mt_hist_set_spill() */
+	struct mt_hist_spill *spill;
+
+	/* First line of the mapped block read ahead for the last */
+	uint64_t ra_first;
+
+	/* Cached position for mt_hist_row() */
+	struct {
+		mt_coord cols;
+		size_t n;
+		uint64_t line;
+	} rcache;
+};
+
+static inline void mt_hist_init(struct mt_hist *self)
+{
+	self->first = 0;
+	self->lines = 0;
+	self->max_lines = MT_HIST_LINES;
+	self->open = 0;
+	self->blk_cnt = 0;
+	self->blk_size = 0;
+	self->blks = NULL;
+	self->spill = NULL;
+	self->ra_first = UINT64_MAX;
+	self->rcache.cols = 0;
+}
+
+void mt_hist_free(struct mt_hist *self);
+
+/*
+ * Sets the maximal number of lines kept in the history.
+ */
+void mt_hist_set_limit(struct mt_hist *self, size_t max_lines);
+
+/*
+ * Once sealed blocks take more than mem_cap bytes the oldest of them are
+ * written into an unlinked temporary file in dir and mapped back read-only,
+ * hence the memory used by the history stays bounded regardless of the
+ * number of lines kept, see mt_hist_set_limit().
+ *
+ * Passing NULL dir stops spilling, blocks that were already spilled stay
+ * mapped until they are dropped.
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_hist_set_spill(struct mt_hist *self, const char *dir, size_t mem_cap);
+
+/*
+ * Appends a row to the history.
+ *
+ * If the previous row was soft-wrapped the cells are appended to the last
+ * line, trailing blanks are trimmed once the line ends.
+ *
+ * Returns non-zero on allocation failure.
+ */
+int mt_hist_push(struct mt_hist *self, const struct mt_char *cells, size_t len,
+                 uint8_t wrapped);
+
+/*
+ * Appends a block restored from a snapshot, blocks have to be appended in
+ * order to an empty history.
+ *
+ * Sealed blocks are never modified so they point into the mapping, the last
+ * block may still grow so it's copied.
+ *
+ * Returns non-zero on allocation failure.
+ */
+int mt_hist_restore_blk(struct mt_hist *self, struct mt_hist_map *map,
+                        const struct mt_hist_blk *blk);
+
+/*
+ * Removes the last line from the history if it continues on the screen.
+ *
+ * The cells are copied into a newly allocated buffer that has to be freed by
+ * the caller. Returns NULL if there is no such line.
+ */
+struct mt_char *mt_hist_pop_open(struct mt_hist *self, size_t *len);
+
+static inline size_t mt_hist_lines(struct mt_hist *self)
+{
+	return self->lines;
+}
+
+/*
+ * Returns cells of a line by its absolute number, NULL if line is not in the
+ * history.
+ */
+const struct mt_char *mt_hist_line(struct mt_hist *self, uint64_t line, size_t *len);
+
+/*
+ * Returns number of rows line of length len occupies at cols width.
+ */
+static inline size_t mt_hist_line_rows(size_t len, mt_coord cols)
+{
+	if (!len)
+		return 1;
+
+	return (len + cols - 1) / cols;
+}
+
+/*
+ * Returns n-th row above the screen when history is wrapped at cols width,
+ * row 0 is the last row of the newest line.
+ *
+ * Consecutive accesses are O(1) since the last position is cached.
+ */
+const struct mt_char *mt_hist_row(struct mt_hist *self, mt_coord cols,
+                                  size_t n, size_t *len);
+
+#endif /* MT_HIST__ */
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <time.h>
+#include "mt-common.h"
+#include "mt-latency.h"
+
+uint64_t mt_latency_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int bucket(uint64_t us)
+{
+	unsigned int e;
+
+	if (us < 16)
+		return us;
+
+	e = 63 - __builtin_clzll(us);
+
+	return MT_MIN(16 + (e - 4) * 8 + ((us >> (e - 3)) & 7), MT_LATENCY_BUCKETS - 1u);
+}
+
+static uint64_t bucket_max(unsigned int idx)
+{
+	unsigned int e;
+
+	if (idx < 16)
+		return idx;
+
+	e = (idx - 16) / 8 + 4;
+
+	return ((uint64_t)(8 + (idx - 16) % 8 + 1) << (e - 3)) - 1;
+}
+
+void mt_latency_add(struct mt_latency *self, uint64_t us)
+{
+	self->buckets[bucket(us)]++;
+	self->cnt++;
+	self->sum += us;
+	self->max = MT_MAX(self->max, us);
+}
+
+void mt_latency_frame(struct mt_latency *self, uint64_t now)
+{
+	uint32_t i;
+
+	for (i = 0; i < self->pending_cnt; i++)
+		mt_latency_add(self, now - self->pending[i]);
+
+	self->pending_cnt = 0;
+}
+
+uint64_t mt_latency_percentile(const struct mt_latency *self, unsigned int pct)
+{
+	uint64_t want = (self->cnt * pct + 99) / 100;
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (!self->cnt)
+		return 0;
+
+	for (i = 0; i < MT_LATENCY_BUCKETS; i++) {
+		sum += self->buckets[i];
+		if (sum >= want)
+			break;
+	}
+
+	return MT_MIN(bucket_max(i), self->max);
+}
+
+void mt_latency_dump(const struct mt_latency *self, FILE *f)
+{
+	unsigned int i;
+
+	fprintf(f, "Latency: %llu keys avg %lluus p50 %lluus p99 %lluus max %lluus\n",
+	        (unsigned long long)self->cnt,
+	        (unsigned long long)(self->cnt ? self->sum / self->cnt : 0),
+	        (unsigned long long)mt_latency_percentile(self, 50),
+	        (unsigned long long)mt_latency_percentile(self, 99),
+	        (unsigned long long)self->max);
+
+	for (i = 0; i < MT_LATENCY_BUCKETS; i++) {
+		if (!self->buckets[i])
+			continue;
+
+		fprintf(f, "  <= %8lluus %u\n", (unsigned long long)bucket_max(i), self->buckets[i]);
+	}
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_LATENCY__
+#define MT_LATENCY__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Keypress to pixel latency histogram.
+ *
+ * Values are in microseconds, buckets below 16us are exact, above that each
+ * power of two is split into 8 buckets, i.e. the error is at most 12.5%.
+ */
+#define MT_LATENCY_BUCKETS 240
+
+/* Maximal number of keypresses waiting for a frame */
+#define MT_LATENCY_PENDING 64
+
+struct mt_latency {
+	uint32_t buckets[MT_LATENCY_BUCKETS];
+	uint64_t cnt;
+	uint64_t sum;
+	uint64_t max;
+
+	/* Timestamps of keypresses that were not shown yet */
+	uint32_t pending_cnt;
+	uint64_t pending[MT_LATENCY_PENDING];
+};
+
+/*
+ * Returns monotonic time in microseconds.
+ */
+uint64_t mt_latency_now(void);
+
+/*
+ * Adds a value to the histogram.
+ */
+void mt_latency_add(struct mt_latency *self, uint64_t us);
+
+/*
+ * Records a keypress, if there are too many keypresses waiting the oldest one
+ * is kept.
+ */
+static inline void mt_latency_key(struct mt_latency *self, uint64_t now)
+{
+	if (self->pending_cnt < MT_LATENCY_PENDING)
+		self->pending[self->pending_cnt++] = now;
+}
+
+/*
+ * Called on the first backend update after the application responded to the
+ * keypresses, all pending keypresses are added to the histogram.
+ */
+void mt_latency_frame(struct mt_latency *self, uint64_t now);
+
+/*
+ * Returns upper bound of the bucket containing the percentile, e.g. 50 for
+ * median.
+ */
+uint64_t mt_latency_percentile(const struct mt_latency *self, unsigned int pct);
+
+/*
+ * Prints count, p50, p99 and max latency and the histogram.
+ */
+void mt_latency_dump(const struct mt_latency *self, FILE *f);
+
+#endif /* MT_LATENCY__ */
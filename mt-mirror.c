@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mt-common.h"
+#include "mt-sbuf.h"
+#include "mt-mirror.h"
+
+static uint64_t time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void damage(void *priv, mt_coord s_col, mt_coord s_row,
+                   mt_coord e_col, mt_coord e_row)
+{
+	struct mt_mirror *self = priv;
+	struct mt_mirror_client *c;
+
+	for (c = self->clients; c; c = c->next)
+		mt_delta_damage(&c->delta, s_col, s_row, e_col, e_row);
+}
+
+static void scroll(void *priv, int lines)
+{
+	struct mt_mirror *self = priv;
+	struct mt_mirror_client *c;
+
+	for (c = self->clients; c; c = c->next)
+		mt_delta_scroll(&c->delta, lines);
+}
+
+static void cursor(void *priv, mt_coord col, mt_coord row, uint8_t set)
+{
+	struct mt_mirror *self = priv;
+	struct mt_mirror_client *c;
+
+	(void)set;
+
+	for (c = self->clients; c; c = c->next)
+		mt_delta_cursor(&c->delta, col, row);
+}
+
+/* Erased rectangle is inclusive */
+static void erase(void *priv, mt_coord s_col, mt_coord s_row,
+                  mt_coord e_col, mt_coord e_row)
+{
+	damage(priv, s_col, s_row, e_col + 1, e_row + 1);
+}
+
+int mt_mirror_init(struct mt_mirror *self, struct mt_sbuf *sbuf, const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	memset(self, 0, sizeof(*self));
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	self->path = strdup(path);
+	if (!self->path)
+		return 1;
+
+	self->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (self->fd < 0)
+		goto err0;
+
+	unlink(path);
+
+	if (bind(self->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(self->fd, 16))
+		goto err1;
+
+	self->sbuf = sbuf;
+	self->screen.damage = damage;
+	self->screen.scroll = scroll;
+	self->screen.cursor = cursor;
+	self->screen.erase = erase;
+	self->screen.priv = self;
+
+	mt_sbuf_screen_add(sbuf, &self->screen);
+
+	return 0;
+err1:
+	close(self->fd);
+err0:
+	free(self->path);
+	return 1;
+}
+
+static void client_free(struct mt_mirror_client *self)
+{
+	close(self->fd);
+	mt_delta_free(&self->delta);
+	mt_wqueue_free(&self->out);
+	free(self);
+}
+
+void mt_mirror_exit(struct mt_mirror *self)
+{
+	struct mt_mirror_client *c, *next;
+
+	for (c = self->clients; c; c = next) {
+		next = c->next;
+		client_free(c);
+	}
+
+	mt_sbuf_screen_rem(self->sbuf, &self->screen);
+
+	close(self->fd);
+	unlink(self->path);
+	free(self->path);
+}
+
+static void accept_clients(struct mt_mirror *self)
+{
+	struct mt_mirror_client *c;
+	int fd;
+
+	while ((fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+		mt_delta_init(&c->delta);
+
+		if (mt_delta_hello(&c->out)) {
+			client_free(c);
+			continue;
+		}
+
+		c->next = self->clients;
+		self->clients = c;
+	}
+}
+
+/*
+ * Returns non-zero if the client should be disconnected.
+ */
+static int client_run(struct mt_mirror *self, struct mt_mirror_client *c,
+                      uint64_t now)
+{
+	if (mt_wqueue_flush(&c->out, c->fd) < 0)
+		return 1;
+
+	/* Client is slow, keep coalescing */
+	if (mt_wqueue_pending(&c->out))
+		return 0;
+
+	if (!mt_delta_pending(&c->delta) || now - c->frame_ms < MT_MIRROR_FRAME_MS)
+		return 0;
+
+	if (mt_delta_encode(&c->delta, self->sbuf, &c->out))
+		return 1;
+
+	c->frame_ms = now;
+
+	return mt_wqueue_flush(&c->out, c->fd) < 0;
+}
+
+void mt_mirror_run(struct mt_mirror *self)
+{
+	struct mt_mirror_client **c = &self->clients;
+	uint64_t now;
+
+	if (mt_sbuf_fast_forward(self->sbuf)) {
+		for (; *c; c = &(*c)->next)
+			mt_delta_keyframe(&(*c)->delta);
+
+		c = &self->clients;
+	}
+
+	now = time_ms();
+
+	if (now - self->accept_ms >= MT_MIRROR_FRAME_MS) {
+		accept_clients(self);
+		self->accept_ms = now;
+	}
+
+	while (*c) {
+		if (client_run(self, *c, now)) {
+			struct mt_mirror_client *tmp = *c;
+
+			*c = tmp->next;
+			client_free(tmp);
+			continue;
+		}
+
+		c = &(*c)->next;
+	}
+}
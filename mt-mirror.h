@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_MIRROR__
+#define MT_MIRROR__
+
+#include <stdint.h>
+#include "mt-screen.h"
+#include "mt-delta.h"
+#include "mt-wqueue.h"
+
+struct mt_sbuf;
+
+/*
+ * Serves screen deltas of a sbuf to clients connected to a Unix socket.
+ *
+ * Clients get a hello and a keyframe on connect and then frames with the
+ * changes. A new frame is encoded for a client only once everything queued
+ * for it was written and at most once per MT_MIRROR_FRAME_MS, until then the
+ * changes are coalesced, so a slow client gets fewer frames but never blocks
+ * the terminal.
+ */
+#define MT_MIRROR_FRAME_MS 20
+
+struct mt_mirror_client {
+	int fd;
+	uint64_t frame_ms;
+	struct mt_delta delta;
+	struct mt_wqueue out;
+	struct mt_mirror_client *next;
+};
+
+struct mt_mirror {
+	int fd;
+	char *path;
+	uint64_t accept_ms;
+	struct mt_sbuf *sbuf;
+	/* Attached to the sbuf, forwards the changes to the clients */
+	struct mt_screen screen;
+	struct mt_mirror_client *clients;
+};
+
+/*
+ * Creates a listening socket at path and attaches the mirror to the sbuf.
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_mirror_init(struct mt_mirror *self, struct mt_sbuf *sbuf, const char *path);
+
+/*
+ * Disconnects clients, detaches from the sbuf and removes the socket.
+ */
+void mt_mirror_exit(struct mt_mirror *self);
+
+static inline int mt_mirror_clients(struct mt_mirror *self)
+{
+	return !!self->clients;
+}
+
+/*
+ * Accepts new clients, encodes frames and writes them to the clients.
+ *
+ * Must be called before mt_sbuf_frame() if the sbuf is in fast-forward mode,
+ * the screen callbacks are not called while fast forwarding, so the clients
+ * get a keyframe instead.
+ */
+void mt_mirror_run(struct mt_mirror *self);
+
+#endif /* MT_MIRROR__ */
@@ -5,6 +5,9 @@
 #include <ctype.h>
 #include "mt-sbuf.h"
 #include "mt-parser.h"
+#include "mt-stats.h"
+#include "mt-trace.h"
+#include "mt-shm.h"
 
 /*
  * Move cursor:
@@ -88,7 +91,7 @@ static void csi_J(struct mt_parser *self)
 		mt_sbuf_erase(self->sbuf, MT_SBUF_ERASE_SCREEN);
 	break;
 	default:
-		fprintf(stderr, "Unhandled CSI J %i\n", par);
+		mt_diag(&self->diag, MT_DIAG_CSI, 0, 'J', par);
 	}
 }
 
@@ -160,7 +163,7 @@ void csi_m(struct mt_parser *self)
 			mt_sbuf_bg_col(self->sbuf, self->bg_col);
 		break;
 		default:
-			fprintf(stderr, "Unhandled CSI %i m\n", self->pars[i]);
+			mt_diag(&self->diag, MT_DIAG_SGR, 0, 'm', self->pars[i]);
 		}
 	}
 }
@@ -193,7 +196,7 @@ static void csi_del_chars(struct mt_parser *self)
 
 static void csi_t(struct mt_parser *self)
 {
-	fprintf(stderr, "CSI t\n");
+	mt_diag(&self->diag, MT_DIAG_CSI, 0, 't', -1);
 }
 
 /*
@@ -208,7 +211,7 @@ static void csi_r(struct mt_parser *self)
 		self->pars[1] = self->sbuf->rows - 1;
 	}
 
-	fprintf(stderr, "SCROLL REGION %i %i\n", self->pars[0], self->pars[1]);
+	mt_diag(&self->diag, MT_DIAG_CSI, 0, 'r', self->pars[0]);
 }
 
 /*
@@ -227,15 +230,9 @@ static void csi_lh(struct mt_parser *self, char csi)
 {
 	unsigned int i;
 
-	for (i = 0; i < self->par_cnt; i++) {
-		switch (self->pars[i]) {
-		case 4:
-			fprintf(stderr, "IRM %c\n", csi);
-		break;
-		default:
-			fprintf(stderr, "Unhandled RM %i\n", self->pars[i]);
-		}
-	}
+	/* None of the modes is implemented */
+	for (i = 0; i < self->par_cnt; i++)
+		mt_diag(&self->diag, MT_DIAG_MODE, 0, csi, self->pars[i]);
 }
 
 /*
@@ -262,7 +259,7 @@ static void csi_c(struct mt_parser *self)
 	if (!self->response)
 		return;
 
-	self->response(self->response_fd, "\e[?6c");
+	self->response(self->priv, "\e[?6c");
 }
 
 /*
@@ -371,10 +368,10 @@ static void do_csi(struct mt_parser *self, char csi)
 	break;
 	/* xterm window manipulation */
 	case 't':
-		fprintf(stderr, "TODO: Xterm window manipulation!\n");
+		mt_diag(&self->diag, MT_DIAG_CSI, 0, csi, -1);
 	break;
 	default:
-		fprintf(stderr, "Unhandled CSI %c %02x\n", isprint(csi) ? csi : ' ', csi);
+		mt_diag(&self->diag, MT_DIAG_CSI, 0, csi, -1);
 	}
 }
 
@@ -389,7 +386,7 @@ static void set_charset(struct mt_parser *self, uint8_t pos, char c)
 		mt_sbuf_set_charset(self->sbuf, pos, c);
 	break;
 	default:
-		fprintf(stderr, "Invalid G%i charset '%c'\n", pos, c);
+		mt_diag(&self->diag, MT_DIAG_CHARSET, 0, c, pos);
 	break;
 	}
 }
@@ -400,6 +397,7 @@ static void set_charset(struct mt_parser *self, uint8_t pos, char c)
  * 1  -> Normal Cursor Keys (DECCKM)
  * 7  -> No Wraparound Mode (DECAWM)
  * 25 -> ide Cursor (DECTCEM)
+ * 2004 -> Bracketed paste mode
  *
  * s == save
  * r == restore
@@ -413,44 +411,48 @@ static void do_csi_dec(struct mt_parser *self, char c)
 	switch (c) {
 	case 's':
 	case 'r':
-		fprintf(stderr, "DEC CSI save/restore\n");
+		mt_diag(&self->diag, MT_DIAG_DEC_MODE, '?', c, -1);
 		return;
 	case 'l':
 	case 'h':
 	break;
 	default:
-		fprintf(stderr, "Invalid DECCSI priv %c\n", c);
+		mt_diag(&self->diag, MT_DIAG_CSI, '?', c, -1);
 	}
 
 	uint8_t val = c == 'l' ? 0 : 1;
 
 	for (i = 0; i < self->par_cnt; i++) {
 		switch (self->pars[i]) {
+		/* TODO: Normal Cursor Keys */
 		case 1:
-			fprintf(stderr, "TODO: Normal Cursor Keys %c\n", c);
+			mt_diag(&self->diag, MT_DIAG_DEC_MODE, '?', c, 1);
 		break;
 		/* DECAWM -- Autowrap Mode */
 		case 7:
 			mt_sbuf_autowrap(self->sbuf, val);
 		break;
+		/* TODO: Cursor blink */
 		case 12:
-			fprintf(stderr, "TODO: Cursor blink %c\n", c);
+			mt_diag(&self->diag, MT_DIAG_DEC_MODE, '?', c, 12);
 		break;
 		case 25:
 			mt_sbuf_cursor_visible(self->sbuf, val);
 		break;
+		/* Bracketed paste mode */
 		case 2004:
-			fprintf(stderr, "TODO: Bracketed paste mode %c\n", c);
+			self->bracketed_paste = val;
 		break;
 		default:
-			fprintf(stderr, "Unhandled DECCSI %u %c\n",
-				self->pars[i], c);
+			mt_diag(&self->diag, MT_DIAG_DEC_MODE, '?', c, self->pars[i]);
 		}
 	}
 }
 
 static void csi_dispatch(struct mt_parser *self, char c)
 {
+	mt_stat_inc(MT_STAT_CSI);
+
 	switch (self->csi_intermediate) {
 	case 0:
 		do_csi(self, c);
@@ -463,14 +465,14 @@ static void csi_dispatch(struct mt_parser *self, char c)
 		if (c == 'p')
 			mt_sbuf_DECSTR(self->sbuf);
 		else
-			fprintf(stderr, "Unhandled CSI!%c\n", c);
+			mt_diag(&self->diag, MT_DIAG_CSI, '!', c, -1);
 	break;
 	/* CSI DA2 - Secondary Device Attributes */
 	case '<':
-		if (c == 'c')
-			self->response(self->response_fd, "\e[32;1;1c");
-		else
-			fprintf(stderr, "Unhandled CSI<%c\n", c);
+		if (c != 'c')
+			mt_diag(&self->diag, MT_DIAG_CSI, '<', c, -1);
+		else if (self->response)
+			self->response(self->priv, "\e[32;1;1c");
 	break;
 	}
 }
@@ -613,9 +615,16 @@ static void csi_entry(struct mt_parser *self)
 	param_reset(self);
 }
 
+static void osc_entry(struct mt_parser *self)
+{
+	mt_stat_inc(MT_STAT_OSC);
+	self->state = VT_OSC;
+}
+
 static void dcs_entry(struct mt_parser *self)
 {
-	fprintf(stderr, "DCS!\n");
+	mt_stat_inc(MT_STAT_DCS);
+	mt_diag(&self->diag, MT_DIAG_DCS, 0, 'P', -1);
 	self->state = VT_DCS_ENTRY;
 	param_reset(self);
 }
@@ -629,13 +638,15 @@ static void esc_dec(struct mt_parser *self, char c)
 		mt_sbuf_cursor_set(self->sbuf, 0, 0);
 	break;
 	default:
-		fprintf(stderr, "Unhandled DEC ESC %c %02x\n", isprint(c) ? c : ' ', c);
+		mt_diag(&self->diag, MT_DIAG_ESC, '#', c, -1);
 	}
 }
 
 static void esc_dispatch(struct mt_parser *self, char c)
 {
 	if (self->csi_intermediate) {
+		mt_stat_inc(MT_STAT_ESC);
+
 		switch (self->csi_intermediate) {
 		/* SCS G0 */
 		case '(':
@@ -650,7 +661,7 @@ static void esc_dispatch(struct mt_parser *self, char c)
 			esc_dec(self, c);
 		break;
 		default:
-			fprintf(stderr, "Unhandled ESC %c %c\n", self->csi_intermediate, c);
+			mt_diag(&self->diag, MT_DIAG_ESC, self->csi_intermediate, c, -1);
 		}
 
 		self->state = VT_GROUND;
@@ -662,13 +673,13 @@ static void esc_dispatch(struct mt_parser *self, char c)
 		csi_entry(self);
 		return;
 	case ']':
-		self->state = VT_OSC;
+		osc_entry(self);
 		return;
+	/* TODO: Save cursor */
 	case '7':
-		fprintf(stderr, "TODO: Save cursor\n");
-	break;
+	/* TODO: Restore cursor */
 	case '8':
-		fprintf(stderr, "TODO: Restore cursor\n");
+		mt_diag(&self->diag, MT_DIAG_ESC, 0, c, -1);
 	break;
 	case 'D':
 		/* IND - Index, moves cursor down - scrolls */
@@ -693,10 +704,11 @@ static void esc_dispatch(struct mt_parser *self, char c)
 	case '>': /* Set numeric keypad mode */
 	break;
 	default:
-		fprintf(stderr, "Unhandled ESC %c %02x\n", isprint(c) ? c : ' ', c);
+		mt_diag(&self->diag, MT_DIAG_ESC, 0, c, -1);
 	break;
 	}
 
+	mt_stat_inc(MT_STAT_ESC);
 	self->state = VT_GROUND;
 }
 
@@ -727,11 +739,13 @@ static void esc_entry(struct mt_parser *self)
  */
 static void parser_ctrl_char(struct mt_parser *self, unsigned char c)
 {
+	mt_stat_inc(MT_STAT_CTRL);
+
 	switch (c) {
 	/* BEL 0x07 */
 	case '\a':
 		if (self->bell)
-			self->bell();
+			self->bell(self->priv);
 	break;
 	/* BS 0x08 */
 	case '\b':
@@ -776,10 +790,10 @@ static void parser_ctrl_char(struct mt_parser *self, unsigned char c)
 	break;
 	/* OSC */
 	case 0x9D:
-		self->state = VT_OSC;
+		osc_entry(self);
 	break;
 	default:
-		fprintf(stderr, "Unhandled control char 0x%02x\n", c);
+		mt_diag(&self->diag, MT_DIAG_CTRL, 0, c, -1);
 	}
 }
 
@@ -813,9 +827,10 @@ static void next_char(struct mt_parser *self, unsigned char c)
 		case ' ' ... 0x7F:
 			mt_sbuf_putc(self->sbuf, c);
 			self->last_gchar = c;
+			mt_stat_inc(MT_STAT_CHARS);
 		break;
 		default:
-			fprintf(stderr, "Unhandled char 0x%02x\n", c);
+			mt_diag(&self->diag, MT_DIAG_CHAR, 0, c, -1);
 		break;
 		}
 	break;
@@ -836,14 +851,23 @@ static void next_char(struct mt_parser *self, unsigned char c)
 			self->state = VT_GROUND;
 	break;
 	default:
-		fprintf(stderr, "INVALID STATE %i\n", self->state);
+		mt_diag(&self->diag, MT_DIAG_STATE, 0, c, self->state);
 	}
 }
 
 void mt_parse(struct mt_parser *self, const char *buf, size_t buf_sz)
 {
+	uint64_t trace = mt_trace_begin();
 	size_t i;
 
+	mt_stat_add(MT_STAT_BYTES, buf_sz);
+
+	mt_shm_begin(self->sbuf);
+
 	for (i = 0; i < buf_sz; i++)
 		next_char(self, buf[i]);
+
+	mt_shm_end(self->sbuf);
+
+	mt_trace_end(MT_TRACE_PARSE, trace, buf_sz);
 }
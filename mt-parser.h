@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "mt-sbuf.h"
+#include "mt-diag.h"
 #include "mt-common.h"
 
 struct mt_sbuf;
@@ -51,6 +52,8 @@ struct mt_parser {
 	uint8_t fg_col:3;
 	uint8_t bg_col:3;
 	uint8_t par_t:1;
+	/* Pasted text is wrapped in ESC [ 200 ~ and ESC [ 201 ~ */
+	uint8_t bracketed_paste:1;
 
 	/*
 	 * Last graphic character for REP (CSI b)
@@ -60,17 +63,22 @@ struct mt_parser {
 	/*
 	 * Callback to optionally send response to application.
 	 */
-	void (*response)(int fd, const char *string);
-	int response_fd;
+	void (*response)(void *priv, const char *string);
 
 	/*
 	 * Bell callback.
 	 */
-	void (*bell)(void);
+	void (*bell)(void *priv);
+
+	/* Passed to the callbacks */
+	void *priv;
 
 	char csi_intermediate;
 	uint16_t pars[MT_MAX_CSI_PARS];
 	uint8_t par_cnt;
+
+	/* Unhandled and invalid input */
+	struct mt_diag diag;
 };
 
 static inline void mt_parser_init(struct mt_parser *parser, struct mt_sbuf *sbuf,
@@ -85,6 +93,7 @@ static inline void mt_parser_init(struct mt_parser *parser, struct mt_sbuf *sbuf
 	sbuf->charset[0] = 'B';
 	sbuf->charset[1] = '0';
 	sbuf->sel_charset = 0;
+	sbuf->diag = &parser->diag;
 
 	mt_sbuf_bg_col(sbuf, bg_col);
 	mt_sbuf_fg_col(sbuf, fg_col);
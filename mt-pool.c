@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pty.h>
+#include "mt-pool.h"
+
+static int spawn(struct mt_pool *self, struct mt_pool_shell *shell)
+{
+	struct winsize ws = {.ws_col = self->cols, .ws_row = self->rows};
+	int flags;
+
+	shell->pid = forkpty(&shell->fd, NULL, NULL, &ws);
+	if (shell->pid < 0)
+		return 1;
+
+	if (shell->pid == 0) {
+		putenv("TERM=xterm");
+		execl(self->shell, self->shell, NULL);
+		_exit(127);
+	}
+
+	flags = fcntl(shell->fd, F_GETFL, 0);
+	fcntl(shell->fd, F_SETFL, flags | O_NONBLOCK);
+
+	/* Shells forked later must not keep the PTY open */
+	fcntl(shell->fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+int mt_pool_fill(struct mt_pool *self)
+{
+	while (self->cnt < self->size) {
+		if (spawn(self, &self->shells[self->cnt]))
+			return 1;
+
+		self->cnt++;
+	}
+
+	return 0;
+}
+
+int mt_pool_get(struct mt_pool *self, pid_t *pid)
+{
+	int fd;
+
+	if (!self->cnt)
+		return -1;
+
+	fd = self->shells[0].fd;
+	*pid = self->shells[0].pid;
+
+	self->cnt--;
+	memmove(self->shells, self->shells + 1, self->cnt * sizeof(struct mt_pool_shell));
+
+	return fd;
+}
+
+void mt_pool_reap(struct mt_pool *self, pid_t pid)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->cnt; i++) {
+		if (self->shells[i].pid != pid)
+			continue;
+
+		close(self->shells[i].fd);
+
+		self->cnt--;
+		memmove(self->shells + i, self->shells + i + 1,
+		        (self->cnt - i) * sizeof(struct mt_pool_shell));
+		return;
+	}
+}
+
+void mt_pool_close(struct mt_pool *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->cnt; i++)
+		close(self->shells[i].fd);
+
+	self->cnt = 0;
+}
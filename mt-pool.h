@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_POOL__
+#define MT_POOL__
+
+#include <sys/types.h>
+
+/*
+ * Shells forked in advance, a new terminal takes a shell that already runs
+ * instead of waiting for forkpty() and the shell startup.
+ *
+ * Shells are children of the process that owns the pool, so the owner has to
+ * reap them and call mt_pool_reap() for each reaped child.
+ */
+#define MT_POOL_MAX 16
+
+struct mt_pool_shell {
+	pid_t pid;
+	/* PTY master, non-blocking */
+	int fd;
+};
+
+struct mt_pool {
+	const char *shell;
+	unsigned int size;
+	unsigned int cnt;
+	/* Size of the terminal shells are started with */
+	unsigned short cols;
+	unsigned short rows;
+	struct mt_pool_shell shells[MT_POOL_MAX];
+};
+
+static inline void mt_pool_init(struct mt_pool *self, const char *shell,
+                                unsigned int size, unsigned short cols,
+                                unsigned short rows)
+{
+	self->shell = shell;
+	self->size = size < MT_POOL_MAX ? size : MT_POOL_MAX;
+	self->cnt = 0;
+	self->cols = cols;
+	self->rows = rows;
+}
+
+/*
+ * Forks shells until the pool is full.
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_pool_fill(struct mt_pool *self);
+
+/*
+ * Takes the oldest shell from the pool.
+ *
+ * Returns the PTY master or -1 if the pool is empty.
+ */
+int mt_pool_get(struct mt_pool *self, pid_t *pid);
+
+/*
+ * Removes a shell that exited from the pool.
+ */
+void mt_pool_reap(struct mt_pool *self, pid_t pid);
+
+/*
+ * Closes the PTYs, which sends SIGHUP to the shells, in a forked child this
+ * only drops the child copies.
+ */
+void mt_pool_close(struct mt_pool *self);
+
+#endif /* MT_POOL__ */
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "mt-common.h"
+#include "mt-stats.h"
+#include "mt-trace.h"
+#include "mt-ring.h"
+
+int mt_ring_init(struct mt_ring *self, size_t size)
+{
+	size_t sz = 1;
+
+	while (sz < size)
+		sz <<= 1;
+
+	self->buf = malloc(sz);
+	if (!self->buf)
+		return 1;
+
+	self->size = sz;
+	self->head = 0;
+	self->tail = 0;
+	self->idle = 0;
+
+	return 0;
+}
+
+void mt_ring_free(struct mt_ring *self)
+{
+	free(self->buf);
+	self->buf = NULL;
+}
+
+static size_t read_size(struct mt_ring *self, int fd)
+{
+	int avail;
+
+	if (self->idle)
+		return MT_RING_MIN_READ;
+
+	mt_stat_inc(MT_STAT_IOCTLS);
+
+	if (ioctl(fd, FIONREAD, &avail) || avail <= 0)
+		return MT_RING_MIN_READ;
+
+	return avail;
+}
+
+ssize_t mt_ring_fill(struct mt_ring *self, int fd)
+{
+	size_t off = self->head & (self->size - 1);
+	size_t len = MT_MIN(read_size(self, fd), mt_ring_free_space(self));
+	struct iovec iov[2];
+	uint64_t trace;
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	iov[0].iov_base = self->buf + off;
+	iov[0].iov_len = MT_MIN(len, self->size - off);
+	iov[1].iov_base = self->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+
+	trace = mt_trace_begin();
+	ret = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+	mt_trace_end(MT_TRACE_READ, trace, ret > 0 ? ret : 0);
+
+	mt_stat_inc(MT_STAT_READS);
+
+	if (ret < 0) {
+		if (errno != EAGAIN)
+			return -1;
+
+		self->idle = 1;
+		return 0;
+	}
+
+	self->idle = !ret;
+	self->head += ret;
+
+	return ret;
+}
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_RING__
+#define MT_RING__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/*
+ * Input ring buffer.
+ *
+ * Data are read from a file descriptor directly into the ring and consumed in
+ * place, in at most two contiguous spans.
+ */
+struct mt_ring {
+	char *buf;
+	/* Power of two */
+	size_t size;
+	/* Free running positions, head - tail is the number of bytes stored */
+	size_t head;
+	size_t tail;
+
+	/* Last fill returned EAGAIN, the next fill does not ask for FIONREAD */
+	uint8_t idle:1;
+};
+
+/* Read size when FIONREAD is not used */
+#define MT_RING_MIN_READ 4096
+
+/*
+ * Allocates ring buffer, size is rounded up to a power of two.
+ *
+ * Returns zero on success, non-zero on allocation failure.
+ */
+int mt_ring_init(struct mt_ring *self, size_t size);
+
+void mt_ring_free(struct mt_ring *self);
+
+static inline size_t mt_ring_used(struct mt_ring *self)
+{
+	return self->head - self->tail;
+}
+
+static inline size_t mt_ring_free_space(struct mt_ring *self)
+{
+	return self->size - mt_ring_used(self);
+}
+
+/*
+ * Returns pointer to the first contiguous span of stored data and its length
+ * or NULL if the ring is empty.
+ */
+static inline const char *mt_ring_span(struct mt_ring *self, size_t *len)
+{
+	size_t off = self->tail & (self->size - 1);
+	size_t used = mt_ring_used(self);
+
+	if (!used)
+		return NULL;
+
+	*len = used < self->size - off ? used : self->size - off;
+
+	return self->buf + off;
+}
+
+/*
+ * Marks len bytes from the start of the ring as consumed.
+ */
+static inline void mt_ring_consume(struct mt_ring *self, size_t len)
+{
+	self->tail += len;
+
+	/* Keep the data contiguous as long as possible */
+	if (self->tail == self->head)
+		self->tail = self->head = 0;
+}
+
+/*
+ * Reads available data from fd into the free space.
+ *
+ * The read size is taken from FIONREAD, so that all data available are read
+ * with a single read(). After a read that found no data the next one is done
+ * without the ioctl() in order not to double syscalls when idle.
+ *
+ * Returns number of bytes read, 0 if there were no data or the ring is full
+ * and -1 on error other than EAGAIN with errno set.
+ */
+ssize_t mt_ring_fill(struct mt_ring *self, int fd);
+
+#endif /* MT_RING__ */
@@ -3,9 +3,12 @@
  * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
  */
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include "mt-sbuf.h"
 #include "mt-screen.h"
+#include "mt-stats.h"
+#include "mt-shm.h"
 
 struct mt_sbuf *mt_sbuf_alloc(void)
 {
@@ -18,108 +21,216 @@ struct mt_sbuf *mt_sbuf_alloc(void)
 	memset(self, 0, sizeof(*self));
 	self->autowrap = 1;
 
+	mt_hist_init(&self->hist);
+
 	return self;
 }
 
-int mt_sbuf_resize(struct mt_sbuf *self, unsigned int n_cols, unsigned int n_rows)
+void mt_sbuf_free(struct mt_sbuf *self)
 {
-	struct mt_char *new_buf;
-	size_t sbuf_sz = n_cols * (2 * n_rows) * sizeof(struct mt_char);
+	if (!self)
+		return;
 
-	new_buf = malloc(sbuf_sz);
-	if (!new_buf)
-		return 1;
+	mt_hist_free(&self->hist);
+	mt_hist_set_spill(&self->hist, NULL, 0);
 
-	memset(new_buf, 0, sbuf_sz);
+	if (self->shm) {
+		mt_shm_free(self->shm);
+	} else {
+		free(self->sbuf);
+		free(self->srow);
+		free(self->spare_sbuf);
+		free(self->spare_srow);
+	}
 
-	if (self->sbuf) {
-		mt_coord row;
-		size_t min_cols = MT_MIN(self->cols, (int)n_cols);
+	free(self->reflow_cells);
+	free(self->reflow_lines);
 
-		for (row = 0; row < MT_MIN(self->rows, (int)n_rows); row++) {
-			struct mt_char *o_row = &self->sbuf[row * self->cols];
-			struct mt_char *n_row = &new_buf[row * n_cols];
-			memcpy(n_row, o_row, min_cols * sizeof(struct mt_char));
-		}
+	free(self);
+}
 
-		free(self->sbuf);
-	}
+static void fill_chars(struct mt_char *chars, const struct mt_char *c, size_t cnt)
+{
+	size_t i;
 
-	self->sbuf = new_buf;
-	self->sbuf_sz = sbuf_sz;
+	for (i = 0; i < cnt; i++)
+		chars[i] = *c;
+}
 
-	if (self->screen && self->screen->damage) {
-		self->screen->damage(self->screen->priv, 0, 0, n_cols, n_rows);
-		//TODO: Redraw!
-	}
+void mt_sbuf_row_fill(struct mt_sbuf *self, size_t idx)
+{
+	struct mt_row *row = &self->srow[idx];
 
-	self->cols = n_cols;
-	self->rows = n_rows;
+	fill_chars(&self->sbuf[idx * self->cols], &row->blank_char, self->cols);
 
-	return 0;
+	row->blank = 0;
 }
 
+/*
+ * Character used to fill erased cells, erased cells keep the current background.
+ */
+static struct mt_char erase_char(struct mt_sbuf *self)
+{
+	struct mt_char c = {
+		.fg_col = self->cur_char.fg_col,
+		.bg_col = self->cur_char.bg_col,
+	};
+
+	return c;
+}
+
+/*
+ * Erases whole row in O(1), the cells are filled on next write.
+ */
 static void clear_row(struct mt_sbuf *self, mt_coord row)
 {
-	struct mt_char *row_addr = mt_sbuf_row(self, row);
+	struct mt_row *srow = &self->srow[mt_sbuf_row_idx(self, row)];
+
+	srow->blank = 1;
+	srow->wrapped = 0;
+	srow->blank_char = erase_char(self);
+}
+
+/*
+ * Returns screen to be notified about changes, NULL in fast-forward mode where
+ * the whole screen is going to be repainted anyway.
+ */
+static struct mt_screen *screen(struct mt_sbuf *self)
+{
+	if (mt_sbuf_fast_forward(self))
+		return NULL;
+
+	return self->screen;
+}
+
+void mt_sbuf_screen_add(struct mt_sbuf *self, struct mt_screen *screen)
+{
+	struct mt_screen **i;
+
+	for (i = &self->screen; *i; i = &(*i)->next);
+
+	screen->next = NULL;
+	*i = screen;
+}
+
+void mt_sbuf_screen_rem(struct mt_sbuf *self, struct mt_screen *screen)
+{
+	struct mt_screen **i;
+
+	for (i = &self->screen; *i; i = &(*i)->next) {
+		if (*i == screen) {
+			*i = screen->next;
+			screen->next = NULL;
+			return;
+		}
+	}
+}
+
+static void damage(struct mt_sbuf *self, mt_coord s_col, mt_coord s_row,
+                   mt_coord e_col, mt_coord e_row)
+{
+	struct mt_screen *s;
 
-	memset(row_addr, 0, sizeof(struct mt_char) * self->cols);
+	for (s = screen(self); s; s = s->next) {
+		if (s->damage)
+			s->damage(s->priv, s_col, s_row, e_col, e_row);
+	}
+}
+
+static void cursor(struct mt_sbuf *self, uint8_t set)
+{
+	struct mt_screen *s;
+
+	for (s = screen(self); s; s = s->next) {
+		if (s->cursor)
+			s->cursor(s->priv, self->cur_col, self->cur_row, set);
+	}
 }
 
 static void scroll_up(struct mt_sbuf *self)
 {
 	if (self->sbuf_off == 0)
-		self->sbuf_off = (self->sbuf_sz / self->cols) - 1;
+		self->sbuf_off = self->rows - 1;
 	else
 		self->sbuf_off -= 1;
 
 	clear_row(self, 0);
 }
 
+/*
+ * Moves the top row into the history.
+ *
+ * If we fail to allocate memory the row is lost, which is the same thing that
+ * happens when history is full.
+ */
+static void hist_push(struct mt_sbuf *self)
+{
+	struct mt_row *srow = &self->srow[mt_sbuf_row_idx(self, 0)];
+
+	if (srow->blank) {
+		mt_hist_push(&self->hist, NULL, 0, 0);
+		return;
+	}
+
+	mt_hist_push(&self->hist, mt_sbuf_row(self, 0), self->cols, srow->wrapped);
+}
+
 static void scroll_down(struct mt_sbuf *self)
 {
-	self->sbuf_off = (self->sbuf_off + 1) % (self->sbuf_sz / self->cols);
+	hist_push(self);
+
+	self->sbuf_off = (self->sbuf_off + 1) % self->rows;
 
 	clear_row(self, self->rows - 1);
 }
 
 static void mt_sbuf_scroll(struct mt_sbuf *self, mt_coord inc)
 {
+	struct mt_screen *s;
+
 	//TODO: Do we need more than sign of inc?
 
+	mt_stat_inc(MT_STAT_SCROLL_LINES);
+
 	if (inc < 0)
 		scroll_up(self);
 	else
 		scroll_down(self);
 
-	if (self->screen && self->screen->scroll)
-		self->screen->scroll(self->screen->priv, inc);
+	if (self->scrolled < self->rows)
+		self->scrolled++;
+
+	for (s = screen(self); s; s = s->next) {
+		if (s->scroll)
+			s->scroll(s->priv, inc);
+	}
 }
 
 static void unset_cursor(struct mt_sbuf *self)
 {
-	struct mt_char *cur = mt_sbuf_char(self, self->cur_col, self->cur_row);
-
 	if (self->cursor_hidden)
 		return;
 
 	//fprintf(stderr, "Unset cursor\n");
 
-	cur->reverse = 0;
+	/* Row was erased, cursor is already gone */
+	if (!mt_sbuf_row_blank(self, self->cur_row))
+		mt_sbuf_char(self, self->cur_col, self->cur_row)->reverse = 0;
 
-	if (self->screen && self->screen->cursor)
-		self->screen->cursor(self->cur_col, self->cur_row, 0);
+	cursor(self, 0);
 }
 
 static void set_cursor(struct mt_sbuf *self)
 {
-	struct mt_char *cur = mt_sbuf_char(self, self->cur_col, self->cur_row);
+	struct mt_char *cur;
 
 	if (self->cursor_hidden)
 		return;
 
 	//fprintf(stderr, "Set cursor\n");
 
+	cur = mt_sbuf_char(self, self->cur_col, self->cur_row);
+
 	cur->reverse = 1;
 
 	if (cur->c == 0) {
@@ -127,8 +238,277 @@ static void set_cursor(struct mt_sbuf *self)
 		cur->bg_col = self->cur_char.bg_col;
 	}
 
-	if (self->screen && self->screen->cursor)
-		self->screen->cursor(self->cur_col, self->cur_row, 1);
+	cursor(self, 1);
+}
+
+/*
+ * Logical line collected from the screen for reflow.
+ */
+struct reflow_line {
+	size_t off;
+	size_t len;
+	size_t rows;
+};
+
+/*
+ * Collects logical lines from the screen, the rest of the line that continues
+ * from history is included as well. Empty rows below the cursor are dropped.
+ *
+ * Trailing empty cells are trimmed, cells with a background color are kept.
+ */
+static size_t reflow_collect(struct mt_sbuf *self, struct mt_char *cells,
+                             size_t open_len, struct reflow_line *lines,
+                             size_t *cur_line, size_t *cur_off)
+{
+	mt_coord row, last_row;
+	size_t line_cnt = 0, start = 0, cells_cnt = open_len;
+
+	for (last_row = self->rows - 1; last_row > self->cur_row; last_row--) {
+		struct mt_row *srow = &self->srow[mt_sbuf_row_idx(self, last_row)];
+
+		if (!srow->blank || !mt_char_empty(&srow->blank_char))
+			break;
+	}
+
+	for (row = 0; row <= last_row; row++) {
+		struct mt_row *srow = &self->srow[mt_sbuf_row_idx(self, row)];
+		size_t len = 0;
+
+		if (!srow->blank) {
+			len = self->cols;
+			memcpy(cells + cells_cnt, mt_sbuf_row(self, row),
+			       len * sizeof(struct mt_char));
+		} else if (!mt_char_empty(&srow->blank_char)) {
+			len = self->cols;
+			fill_chars(cells + cells_cnt, &srow->blank_char, len);
+		}
+
+		if (row == self->cur_row) {
+			*cur_line = line_cnt;
+			*cur_off = cells_cnt - start + self->cur_col;
+		}
+
+		if (srow->wrapped && row < last_row) {
+			cells_cnt += len;
+			continue;
+		}
+
+		while (len && mt_char_empty(&cells[cells_cnt + len - 1]))
+			len--;
+
+		cells_cnt += len;
+
+		lines[line_cnt].off = start;
+		lines[line_cnt].len = cells_cnt - start;
+		line_cnt++;
+
+		start = cells_cnt;
+	}
+
+	return line_cnt;
+}
+
+/*
+ * Lays out logical lines at the new width, rows that do not fit the screen
+ * are pushed into the history.
+ *
+ * Rows are pushed from the top so that the history stays in order, if the
+ * rows below the cursor do not fit the cursor ends up on the first row.
+ */
+static void reflow_layout(struct mt_sbuf *self, struct mt_char *cells,
+                          struct reflow_line *lines, size_t line_cnt,
+                          size_t cur_line, size_t cur_off,
+                          struct mt_char *n_buf, struct mt_row *n_srow,
+                          mt_coord n_cols, mt_coord n_rows)
+{
+	struct mt_char blank = {};
+	size_t i, j, total = 0, cur_row = 0;
+	long skip, out;
+
+	for (i = 0; i < line_cnt; i++) {
+		lines[i].rows = mt_hist_line_rows(lines[i].len, n_cols);
+
+		if (i == cur_line) {
+			lines[i].rows = MT_MAX(lines[i].rows, cur_off / n_cols + 1);
+			cur_row = total + cur_off / n_cols;
+		}
+
+		total += lines[i].rows;
+	}
+
+	skip = total > (size_t)n_rows ? total - n_rows : 0;
+
+	for (out = -skip, i = 0; i < line_cnt; i++) {
+		for (j = 0; j < lines[i].rows; j++, out++) {
+			struct mt_char *src = cells + lines[i].off + j * n_cols;
+			size_t s = j * n_cols;
+			size_t len = s < lines[i].len ? MT_MIN((size_t)n_cols, lines[i].len - s) : 0;
+			uint8_t wrapped = j + 1 < lines[i].rows;
+			struct mt_char *dst;
+
+			if (out < 0) {
+				mt_hist_push(&self->hist, src, len, wrapped);
+				continue;
+			}
+
+			if (out >= n_rows)
+				break;
+
+			n_srow[out].wrapped = wrapped;
+
+			if (!len)
+				continue;
+
+			dst = &n_buf[out * n_cols];
+			memcpy(dst, src, len * sizeof(struct mt_char));
+			fill_chars(dst + len, &blank, n_cols - len);
+			n_srow[out].blank = 0;
+		}
+	}
+
+	self->cur_row = MT_MAX((long)cur_row - skip, 0);
+	self->cur_col = cur_off % n_cols;
+}
+
+/*
+ * Makes sure buffer has space for at least size elements, the content is not
+ * preserved.
+ */
+static int reserve(void **buf, size_t *buf_sz, size_t size, size_t elem_size)
+{
+	void *new_buf;
+
+	if (*buf_sz >= size)
+		return 0;
+
+	new_buf = malloc(size * elem_size);
+	if (!new_buf)
+		return 1;
+
+	free(*buf);
+
+	*buf = new_buf;
+	*buf_sz = size;
+
+	return 0;
+}
+
+static int reflow(struct mt_sbuf *self, struct mt_char *n_buf, struct mt_row *n_srow,
+                  mt_coord n_cols, mt_coord n_rows)
+{
+	struct mt_char *open, *cells;
+	struct reflow_line *lines;
+	size_t open_len = 0, line_cnt, cur_line = 0, cur_off = 0;
+
+	open = mt_hist_pop_open(&self->hist, &open_len);
+
+	if (reserve((void**)&self->reflow_cells, &self->reflow_cells_sz,
+	            open_len + self->rows * self->cols, sizeof(struct mt_char)) ||
+	    reserve((void**)&self->reflow_lines, &self->reflow_lines_sz,
+	            self->rows, sizeof(struct reflow_line))) {
+		if (open)
+			mt_hist_push(&self->hist, open, open_len, 1);
+		free(open);
+		return 1;
+	}
+
+	cells = self->reflow_cells;
+	lines = self->reflow_lines;
+
+	if (open) {
+		memcpy(cells, open, open_len * sizeof(struct mt_char));
+		free(open);
+	}
+
+	line_cnt = reflow_collect(self, cells, open_len, lines, &cur_line, &cur_off);
+
+	reflow_layout(self, cells, lines, line_cnt, cur_line, cur_off,
+	              n_buf, n_srow, n_cols, n_rows);
+
+	return 0;
+}
+
+/*
+ * Cells are not initialized here, rows are filled on a first write.
+ */
+static int reserve_spare(struct mt_sbuf *self, unsigned int n_cols, unsigned int n_rows)
+{
+	if (self->shm)
+		return mt_shm_reserve(self, n_cols * n_rows, n_rows);
+
+	if (reserve((void**)&self->spare_sbuf, &self->spare_sbuf_sz,
+	            n_cols * n_rows, sizeof(struct mt_char)))
+		return 1;
+
+	return reserve((void**)&self->spare_srow, &self->spare_srow_sz,
+	               n_rows, sizeof(struct mt_row));
+}
+
+static int resize(struct mt_sbuf *self, unsigned int n_cols, unsigned int n_rows)
+{
+	struct mt_char *new_buf;
+	struct mt_row *new_srow;
+	struct mt_screen *s;
+	int reflowed = !!self->sbuf;
+	mt_coord row;
+
+	if (reserve_spare(self, n_cols, n_rows))
+		return 1;
+
+	new_buf = self->spare_sbuf;
+	new_srow = self->spare_srow;
+
+	memset(new_srow, 0, n_rows * sizeof(struct mt_row));
+
+	for (row = 0; row < (mt_coord)n_rows; row++)
+		new_srow[row].blank = 1;
+
+	if (self->sbuf) {
+		unset_cursor(self);
+
+		if (reflow(self, new_buf, new_srow, n_cols, n_rows)) {
+			set_cursor(self);
+			return 1;
+		}
+	}
+
+	MT_SWAP(self->sbuf, self->spare_sbuf);
+	MT_SWAP(self->sbuf_sz, self->spare_sbuf_sz);
+	MT_SWAP(self->srow, self->spare_srow);
+	MT_SWAP(self->srow_sz, self->spare_srow_sz);
+
+	self->sbuf_off = 0;
+
+	/* Whole screen is repainted even in fast-forward mode */
+	for (s = self->screen; s; s = s->next) {
+		if (s->damage)
+			s->damage(s->priv, 0, 0, n_cols, n_rows);
+		//TODO: Redraw!
+	}
+
+	self->cols = n_cols;
+	self->rows = n_rows;
+
+	if (reflowed)
+		set_cursor(self);
+
+	return 0;
+}
+
+int mt_sbuf_resize(struct mt_sbuf *self, unsigned int n_cols, unsigned int n_rows)
+{
+	int ret;
+
+	if (!n_cols || !n_rows) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	mt_shm_begin(self);
+	ret = resize(self, n_cols, n_rows);
+	mt_shm_end(self);
+
+	return ret;
 }
 
 int mt_sbuf_cursor_move(struct mt_sbuf *self, mt_coord col_inc, mt_coord row_inc)
@@ -211,8 +591,7 @@ void mt_sbuf_insert_blank(struct mt_sbuf *self, uint16_t blanks)
 	for (i = 0; i < blanks && i < self->cols; i++)
 		row[self->cur_col + i] = space;
 
-	if (self->screen && self->screen->damage)
-		self->screen->damage(self->screen->priv, self->cur_col, self->cur_row, self->cols-1, self->cur_row+1);
+	damage(self, self->cur_col, self->cur_row, self->cols, self->cur_row+1);
 
 	set_cursor(self);
 }
@@ -235,8 +614,7 @@ void mt_sbuf_del_chars(struct mt_sbuf *self, uint16_t dels)
 	for (i = self->cols - dels - 1; i < self->cols; i++)
 		row[i] = space;
 
-	if (self->screen && self->screen->damage)
-		self->screen->damage(self->screen->priv, self->cur_col, self->cur_row, self->cols-1, self->cur_row+1);
+	damage(self, self->cur_col, self->cur_row, self->cols, self->cur_row+1);
 
 	set_cursor(self);
 }
@@ -267,8 +645,10 @@ void mt_sbuf_cursor_inc(struct mt_sbuf *self)
 			self->cur_col--;
 		} else {
 			self->cur_col = 0;
-			if (self->autowrap)
+			if (self->autowrap) {
+				self->srow[mt_sbuf_row_idx(self, self->cur_row)].wrapped = 1;
 				self->cur_row++;
+			}
 		}
 
 	}
@@ -325,7 +705,8 @@ void mt_sbuf_putc(struct mt_sbuf *self, char c)
 	/* US */
 	if (charset == 'B') {
 		if (!isprint(c)) {
-			fprintf(stderr, "Invalid character %c!", c);
+			if (self->diag)
+				mt_diag(self->diag, MT_DIAG_CHAR, 0, c, -1);
 			return;
 		}
 	}
@@ -363,8 +744,7 @@ void mt_sbuf_putc(struct mt_sbuf *self, char c)
 		mc->reverse = 0;
 	}
 
-	if (self->screen && self->screen->damage)
-		self->screen->damage(self->screen->priv, self->cur_col, self->cur_row, self->cur_col+1, self->cur_row+1);
+	damage(self, self->cur_col, self->cur_row, self->cur_col+1, self->cur_row+1);
 
 	mt_sbuf_cursor_inc(self);
 }
@@ -372,15 +752,28 @@ void mt_sbuf_putc(struct mt_sbuf *self, char c)
 static void erase(struct mt_sbuf *self, mt_coord s_col, mt_coord s_row,
                   mt_coord e_col, mt_coord e_row)
 {
+	struct mt_char blank = erase_char(self);
+	struct mt_screen *s;
 	struct mt_char *row;
 	mt_coord r;
 
-	if (self->screen && self->screen->erase)
-		self->screen->erase(s_col, s_row, e_col, e_row);
+	for (s = screen(self); s; s = s->next) {
+		if (s->erase)
+			s->erase(s->priv, s_col, s_row, e_col, e_row);
+	}
 
 	for (r = s_row; r <= e_row; r++) {
+		if (s_col == 0 && e_col == self->cols - 1) {
+			clear_row(self, r);
+			continue;
+		}
+
+		if (mt_sbuf_row_blank(self, r) &&
+		    !memcmp(mt_sbuf_row_blank_char(self, r), &blank, sizeof(blank)))
+			continue;
+
 		row = mt_sbuf_row(self, r);
-		memset(row + s_col, 0, (e_col - s_col + 1) * sizeof(*row));
+		fill_chars(row + s_col, &blank, e_col - s_col + 1);
 	}
 }
 
@@ -412,6 +805,42 @@ void mt_sbuf_erase(struct mt_sbuf *self, enum mt_sbuf_erase_t type)
 	}
 }
 
+int mt_sbuf_line_to_screen(struct mt_sbuf *self, uint64_t line, size_t col,
+                           mt_coord *row, mt_coord *scol)
+{
+	uint64_t cur = mt_sbuf_screen_line(self);
+	size_t open_len = 0;
+	mt_coord r = 0;
+
+	if (line < cur)
+		return 1;
+
+	if (line == cur && self->hist.open) {
+		mt_hist_line(&self->hist, cur, &open_len);
+
+		if (col < open_len)
+			return 1;
+
+		col -= open_len;
+	}
+
+	while (cur < line && r < self->rows) {
+		if (!mt_sbuf_row_wrapped(self, r))
+			cur++;
+		r++;
+	}
+
+	r += col / self->cols;
+
+	if (r >= self->rows)
+		return 1;
+
+	*row = r;
+	*scol = col % self->cols;
+
+	return 0;
+}
+
 void mt_sbuf_dump_screen(struct mt_sbuf *self)
 {
 	int col, row;
@@ -425,6 +854,12 @@ void mt_sbuf_dump_screen(struct mt_sbuf *self)
 
 	for (row = 0; row < self->rows; row++) {
 		printf("|");
+		if (mt_sbuf_row_blank(self, row)) {
+			for (col = 0; col < self->cols; col++)
+				printf(" ");
+			printf("|\n");
+			continue;
+		}
 		struct mt_char *c = mt_sbuf_row(self, row);
 		for (col = 0; col < self->cols; col++) {
 			if (isprint(mt_char_c(&c[col])))
@@ -8,6 +8,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "mt-common.h"
+#include "mt-hist.h"
+#include "mt-diag.h"
 
 struct mt_char {
 	uint8_t c;
@@ -43,7 +45,32 @@ static inline char mt_char_c(const struct mt_char *c)
 	return c->c;
 }
 
+/*
+ * Returns non-zero if the cell looks the same as the padding of a trimmed
+ * line, i.e. no character and the default background.
+ */
+static inline int mt_char_empty(const struct mt_char *c)
+{
+	return !c->c && !c->bg_col && !c->reverse;
+}
+
+/*
+ * Per row state.
+ *
+ * Rows that were erased as a whole are only marked blank and the cells are
+ * filled with the blank_char lazily on a first write into the row.
+ *
+ * Rows that were soft-wrapped, i.e. continue on the next row, are marked
+ * wrapped so that logical lines can be reflowed on resize.
+ */
+struct mt_row {
+	uint8_t blank:1;
+	uint8_t wrapped:1;
+	struct mt_char blank_char;
+};
+
 struct mt_screen;
+struct mt_shm;
 
 struct mt_sbuf {
 	mt_coord cols;
@@ -58,14 +85,46 @@ struct mt_sbuf {
 
 	uint8_t cursor_hidden:1;
 	uint8_t autowrap:1;
+	/* Renderer repaints everything when the screen scrolled away */
+	uint8_t fast_forward:1;
+
+	/* Lines scrolled since the last mt_sbuf_frame(), saturated at rows */
+	mt_coord scrolled;
 
 	struct mt_char cur_char;
 
+	/* List of screens notified about changes */
 	struct mt_screen *screen;
 
-	size_t sbuf_sz;
+	/* Diagnostics for invalid characters, optional */
+	struct mt_diag *diag;
+
+	/* Grid cells rows * cols and per row state */
 	size_t sbuf_off;
 	struct mt_char *sbuf;
+	struct mt_row *srow;
+
+	/* Allocated sizes, grid is reallocated only when it grows over these */
+	size_t sbuf_sz;
+	size_t srow_sz;
+
+	/* Spare grid resize reflows into, swapped with the grid afterwards */
+	struct mt_char *spare_sbuf;
+	struct mt_row *spare_srow;
+	size_t spare_sbuf_sz;
+	size_t spare_srow_sz;
+
+	/* Scratch buffers for reflow, reused between resizes */
+	struct mt_char *reflow_cells;
+	struct reflow_line *reflow_lines;
+	size_t reflow_cells_sz;
+	size_t reflow_lines_sz;
+
+	/* Rows that scrolled out of the screen */
+	struct mt_hist hist;
+
+	/* Grid is in a shared mapping, see mt_shm_export() */
+	struct mt_shm *shm;
 };
 
 /*
@@ -97,6 +156,45 @@ static inline void mt_sbuf_autowrap(struct mt_sbuf *self, uint8_t autowrap)
 	self->autowrap = !!autowrap;
 }
 
+/*
+ * Attaches a screen, screens are notified in the order they were attached.
+ */
+void mt_sbuf_screen_add(struct mt_sbuf *self, struct mt_screen *screen);
+
+/*
+ * Detaches a screen.
+ */
+void mt_sbuf_screen_rem(struct mt_sbuf *self, struct mt_screen *screen);
+
+/*
+ * Enables fast-forward mode.
+ *
+ * Once the screen scrolled at least by its height since the last frame the
+ * screen callbacks are no longer called and the attached screens are expected
+ * to repaint the whole screen instead, see mt_sbuf_fast_forward().
+ */
+static inline void mt_sbuf_set_fast_forward(struct mt_sbuf *self, uint8_t enable)
+{
+	self->fast_forward = !!enable;
+}
+
+/*
+ * Returns non-zero if the whole screen has to be repainted because the
+ * content scrolled away since the last frame.
+ */
+static inline int mt_sbuf_fast_forward(struct mt_sbuf *self)
+{
+	return self->fast_forward && self->scrolled >= self->rows;
+}
+
+/*
+ * Should be called by the renderer after each frame.
+ */
+static inline void mt_sbuf_frame(struct mt_sbuf *self)
+{
+	self->scrolled = 0;
+}
+
 /*
  * Returns current charset
  */
@@ -122,9 +220,63 @@ void mt_sbuf_insert_blank(struct mt_sbuf *self, uint16_t blanks);
 
 void mt_sbuf_del_chars(struct mt_sbuf *self, uint16_t dels);
 
+static inline size_t mt_sbuf_row_idx(struct mt_sbuf *self, mt_coord row)
+{
+	return (row + self->sbuf_off) % self->rows;
+}
+
+/*
+ * Returns non-zero if the row is blank, i.e. filled with mt_sbuf_row_blank_char().
+ */
+static inline int mt_sbuf_row_blank(struct mt_sbuf *self, mt_coord row)
+{
+	return self->srow[mt_sbuf_row_idx(self, row)].blank;
+}
+
+static inline const struct mt_char *mt_sbuf_row_blank_char(struct mt_sbuf *self, mt_coord row)
+{
+	return &self->srow[mt_sbuf_row_idx(self, row)].blank_char;
+}
+
+static inline int mt_sbuf_row_wrapped(struct mt_sbuf *self, mt_coord row)
+{
+	return self->srow[mt_sbuf_row_idx(self, row)].wrapped;
+}
+
+/*
+ * Absolute number of the first logical line on the screen, continues the line
+ * numbering in the history. The line starts in the history if the last history
+ * line was soft-wrapped.
+ */
+static inline uint64_t mt_sbuf_screen_line(struct mt_sbuf *self)
+{
+	return self->hist.first + self->hist.lines - self->hist.open;
+}
+
+/*
+ * Maps a position in a logical line to a screen position.
+ *
+ * Returns non-zero if the position is not on the screen.
+ */
+int mt_sbuf_line_to_screen(struct mt_sbuf *self, uint64_t line, size_t col,
+                           mt_coord *row, mt_coord *scol);
+
+/*
+ * Fills blank row with the blank character, called before row is modified.
+ */
+void mt_sbuf_row_fill(struct mt_sbuf *self, size_t idx);
+
+/*
+ * Returns row cells, blank rows are filled first.
+ */
 static inline struct mt_char *mt_sbuf_row(struct mt_sbuf *self, mt_coord row)
 {
-	return &self->sbuf[((row + self->sbuf_off) % self->rows) * self->cols];
+	size_t idx = mt_sbuf_row_idx(self, row);
+
+	if (self->srow[idx].blank)
+		mt_sbuf_row_fill(self, idx);
+
+	return &self->sbuf[idx * self->cols];
 }
 
 static inline struct mt_char *mt_sbuf_char(struct mt_sbuf *self,
@@ -162,6 +314,18 @@ static inline const struct mt_char *mt_sbuf_cur_char(struct mt_sbuf *self)
 
 struct mt_sbuf *mt_sbuf_alloc(void);
 
+void mt_sbuf_free(struct mt_sbuf *self);
+
+/*
+ * Resizes the screen, logical lines are reflowed to the new width and rows
+ * that do not fit are moved to the history.
+ *
+ * The grid is double buffered and memory is reused as long as the new size
+ * fits into the previously allocated buffers.
+ *
+ * Returns zero on success, non-zero on allocation failure or if the size is
+ * zero with errno set to EINVAL.
+ */
 int mt_sbuf_resize(struct mt_sbuf *self, unsigned int n_cols, unsigned int n_rows);
 
 int mt_sbuf_cursor_move(struct mt_sbuf *self, mt_coord col_inc, mt_coord row_inc);
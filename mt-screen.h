@@ -7,13 +7,22 @@
 
 #include "mt-common.h"
 
+/*
+ * Screen change callbacks, priv is passed to each of them.
+ *
+ * Any number of screens can be attached to a sbuf, e.g. a renderer and a
+ * recorder, see mt_sbuf_screen_add().
+ */
 struct mt_screen {
 	void (*damage)(void *priv, mt_coord s_col, mt_coord s_row, mt_coord e_col, mt_coord e_row);
 	void (*scroll)(void *priv, int lines);
-	void (*cursor)(mt_coord col, mt_coord row, uint8_t set);
-	void (*erase)(mt_coord o_col, mt_coord o_row, mt_coord n_col, mt_coord n_row);
+	void (*cursor)(void *priv, mt_coord col, mt_coord row, uint8_t set);
+	void (*erase)(void *priv, mt_coord o_col, mt_coord o_row, mt_coord n_col, mt_coord n_row);
 
 	void *priv;
+
+	/* Next screen attached to the same sbuf */
+	struct mt_screen *next;
 };
 
 struct mt_damage {
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+#include <pthread.h>
+#include "mt-sbuf.h"
+#include "mt-hist.h"
+#include "mt-search.h"
+
+/*
+ * Lines converted to text separated by newlines.
+ */
+struct text {
+	uint64_t first;
+	size_t line_cnt;
+	size_t line_size;
+	/* line_cnt + 1 line offsets into buf */
+	size_t *line_start;
+	size_t len;
+	size_t size;
+	char *buf;
+};
+
+struct mt_search {
+	enum mt_search_flags flags;
+
+	char *needle;
+	size_t needle_len;
+	regex_t re;
+
+	/* Hashed trigrams of the lowercased needle */
+	unsigned int *trigrams;
+	size_t trigram_cnt;
+
+	/* Sealed blocks searched by the worker, newest first */
+	struct mt_hist_blk **blks;
+	size_t blk_cnt;
+	/* Blocks skipped by the trigram index */
+	size_t blks_skipped;
+
+	struct text text;
+
+	pthread_t thread;
+	int thread_running;
+	int cancel;
+
+	pthread_mutex_t lock;
+	int done;
+	size_t match_cnt;
+	size_t match_size;
+	struct mt_match *matches;
+};
+
+static int text_reserve(struct text *t, size_t len, size_t lines)
+{
+	if (len > t->size) {
+		char *buf = realloc(t->buf, len);
+
+		if (!buf)
+			return 1;
+
+		t->buf = buf;
+		t->size = len;
+	}
+
+	if (lines + 1 > t->line_size) {
+		size_t *line_start = realloc(t->line_start, (lines + 1) * sizeof(size_t));
+
+		if (!line_start)
+			return 1;
+
+		t->line_start = line_start;
+		t->line_size = lines + 1;
+	}
+
+	t->len = 0;
+	t->line_cnt = 0;
+
+	return 0;
+}
+
+static void text_append(struct text *t, const struct mt_char *cells, size_t len, int lower)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		char c = cells[i].c ? cells[i].c : ' ';
+
+		t->buf[t->len++] = lower ? tolower(c) : c;
+	}
+}
+
+static void text_line_start(struct text *t)
+{
+	t->line_start[t->line_cnt++] = t->len;
+}
+
+static void text_line_end(struct text *t)
+{
+	t->buf[t->len++] = '\n';
+}
+
+static void text_finish(struct text *t)
+{
+	t->line_start[t->line_cnt] = t->len;
+}
+
+static int text_blk(struct text *t, struct mt_hist_blk *blk, uint32_t line_cnt, int lower)
+{
+	uint32_t i;
+
+	if (text_reserve(t, blk->cells_used + line_cnt, line_cnt))
+		return 1;
+
+	t->first = blk->first;
+
+	for (i = 0; i < line_cnt; i++) {
+		text_line_start(t);
+		text_append(t, blk->cells + blk->line_off[i],
+		            blk->line_off[i+1] - blk->line_off[i], lower);
+		text_line_end(t);
+	}
+
+	text_finish(t);
+
+	return 0;
+}
+
+static int text_screen(struct text *t, struct mt_sbuf *sbuf, int lower)
+{
+	const struct mt_char *open = NULL;
+	size_t open_len = 0;
+	mt_coord row;
+
+	t->first = mt_sbuf_screen_line(sbuf);
+
+	if (sbuf->hist.open)
+		open = mt_hist_line(&sbuf->hist, t->first, &open_len);
+
+	if (text_reserve(t, open_len + sbuf->rows * (sbuf->cols + 1), sbuf->rows))
+		return 1;
+
+	text_line_start(t);
+
+	if (open)
+		text_append(t, open, open_len, lower);
+
+	for (row = 0; row < sbuf->rows; row++) {
+		int wrapped = mt_sbuf_row_wrapped(sbuf, row);
+
+		/* Trimmed the same way as rows pushed into the history */
+		if (!mt_sbuf_row_blank(sbuf, row)) {
+			const struct mt_char *cells = mt_sbuf_row(sbuf, row);
+			size_t len = sbuf->cols;
+
+			if (!wrapped) {
+				while (len && mt_char_empty(&cells[len-1]))
+					len--;
+			}
+
+			text_append(t, cells, len, lower);
+		}
+
+		if (wrapped && row + 1 < sbuf->rows)
+			continue;
+
+		text_line_end(t);
+
+		if (row + 1 < sbuf->rows)
+			text_line_start(t);
+	}
+
+	text_finish(t);
+
+	return 0;
+}
+
+static int add_match(struct mt_search *self, uint64_t line, size_t col, size_t len)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (self->match_cnt >= MT_SEARCH_MAX_MATCHES) {
+		ret = 1;
+		goto exit;
+	}
+
+	if (self->match_cnt >= self->match_size) {
+		size_t match_size = MT_MAX(2 * self->match_size, (size_t)64);
+		struct mt_match *matches;
+
+		matches = realloc(self->matches, match_size * sizeof(struct mt_match));
+		if (!matches) {
+			ret = 1;
+			goto exit;
+		}
+
+		self->matches = matches;
+		self->match_size = match_size;
+	}
+
+	self->matches[self->match_cnt++] = (struct mt_match) {
+		.line = line,
+		.col = col,
+		.len = len,
+	};
+exit:
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+/*
+ * Substring search, glibc memmem() is vectorized so we scan the whole text
+ * at once and map the hits back to lines.
+ */
+static int scan_memmem(struct mt_search *self, struct text *t)
+{
+	const char *p = t->buf, *end = t->buf + t->len, *hit;
+	size_t i = 0;
+
+	while ((hit = memmem(p, end - p, self->needle, self->needle_len))) {
+		size_t off = hit - t->buf;
+
+		while (t->line_start[i+1] <= off)
+			i++;
+
+		if (add_match(self, t->first + i, off - t->line_start[i], self->needle_len))
+			return 1;
+
+		p = hit + self->needle_len;
+	}
+
+	return 0;
+}
+
+static int scan_regex(struct mt_search *self, struct text *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->line_cnt; i++) {
+		char *line = t->buf + t->line_start[i];
+		size_t len = t->line_start[i+1] - t->line_start[i] - 1;
+		size_t off = 0;
+		int eflags = 0;
+		regmatch_t m;
+
+		line[len] = 0;
+
+		while (off < len && !regexec(&self->re, line + off, 1, &m, eflags)) {
+			if (m.rm_so == m.rm_eo) {
+				off += m.rm_so + 1;
+			} else {
+				if (add_match(self, t->first + i, off + m.rm_so, m.rm_eo - m.rm_so))
+					return 1;
+
+				off += m.rm_eo;
+			}
+
+			eflags = REG_NOTBOL;
+		}
+	}
+
+	return 0;
+}
+
+static int scan_text(struct mt_search *self, struct text *t)
+{
+	if (self->flags & MT_SEARCH_REGEX)
+		return scan_regex(self, t);
+
+	return scan_memmem(self, t);
+}
+
+static int lower_text(struct mt_search *self)
+{
+	return (self->flags & MT_SEARCH_ICASE) && !(self->flags & MT_SEARCH_REGEX);
+}
+
+/*
+ * Returns zero if the block cannot contain the needle.
+ */
+static int blk_may_match(struct mt_search *self, struct mt_hist_blk *blk)
+{
+	size_t i;
+
+	if (!blk->sealed || (self->flags & MT_SEARCH_REGEX))
+		return 1;
+
+	for (i = 0; i < self->trigram_cnt; i++) {
+		if (!mt_hist_blk_idx_has(blk, self->trigrams[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int scan_blk(struct mt_search *self, struct mt_hist_blk *blk, uint32_t line_cnt)
+{
+	int ret;
+
+	if (!blk_may_match(self, blk)) {
+		__atomic_add_fetch(&self->blks_skipped, 1, __ATOMIC_RELAXED);
+		ret = 0;
+	} else if (text_blk(&self->text, blk, line_cnt, lower_text(self))) {
+		ret = 1;
+	} else {
+		ret = scan_text(self, &self->text);
+	}
+
+	/* Spilled history is not kept mapped after a search */
+	mt_hist_blk_unmap(blk);
+
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	struct mt_search *self = arg;
+	size_t i;
+
+	for (i = 0; i < self->blk_cnt; i++) {
+		if (__atomic_load_n(&self->cancel, __ATOMIC_ACQUIRE))
+			break;
+
+		if (scan_blk(self, self->blks[i], self->blks[i]->line_cnt))
+			break;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	self->done = 1;
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+static int init_needle(struct mt_search *self, const char *pattern)
+{
+	size_t i;
+
+	self->needle_len = strlen(pattern);
+	if (!self->needle_len)
+		return 1;
+
+	self->needle = strdup(pattern);
+	if (!self->needle)
+		return 1;
+
+	if (self->flags & MT_SEARCH_ICASE) {
+		for (i = 0; i < self->needle_len; i++)
+			self->needle[i] = tolower(self->needle[i]);
+	}
+
+	if (self->needle_len < 3)
+		return 0;
+
+	self->trigram_cnt = self->needle_len - 2;
+	self->trigrams = malloc(self->trigram_cnt * sizeof(unsigned int));
+	if (!self->trigrams)
+		return 1;
+
+	for (i = 0; i < self->trigram_cnt; i++) {
+		self->trigrams[i] = mt_hist_trigram(tolower(self->needle[i]),
+		                                    tolower(self->needle[i+1]),
+		                                    tolower(self->needle[i+2]));
+	}
+
+	return 0;
+}
+
+/*
+ * Searches the screen and blocks that are not sealed, sealed blocks are
+ * referenced and passed to the worker.
+ */
+static int scan_sync(struct mt_search *self, struct mt_sbuf *sbuf)
+{
+	struct mt_hist *hist = &sbuf->hist;
+	size_t i;
+
+	self->blks = malloc(MT_MAX(hist->blk_cnt, (size_t)1) * sizeof(struct mt_hist_blk *));
+	if (!self->blks)
+		return -1;
+
+	if (text_screen(&self->text, sbuf, lower_text(self)))
+		return -1;
+
+	if (scan_text(self, &self->text))
+		return 1;
+
+	for (i = hist->blk_cnt; i-- > 0;) {
+		struct mt_hist_blk *blk = hist->blks[i];
+		uint32_t line_cnt = blk->line_cnt;
+
+		if (blk->sealed) {
+			mt_hist_blk_get(blk);
+			self->blks[self->blk_cnt++] = blk;
+			continue;
+		}
+
+		/* Open line is searched as a part of the screen */
+		if (i + 1 == hist->blk_cnt && hist->open)
+			line_cnt--;
+
+		if (scan_blk(self, blk, line_cnt))
+			return 1;
+	}
+
+	return 0;
+}
+
+struct mt_search *mt_search_start(struct mt_sbuf *sbuf, const char *pattern,
+                                  enum mt_search_flags flags)
+{
+	struct mt_search *self;
+	int ret;
+
+	self = malloc(sizeof(struct mt_search));
+	if (!self)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+
+	self->flags = flags;
+
+	if (flags & MT_SEARCH_REGEX) {
+		int cflags = REG_EXTENDED | ((flags & MT_SEARCH_ICASE) ? REG_ICASE : 0);
+
+		if (regcomp(&self->re, pattern, cflags)) {
+			free(self);
+			return NULL;
+		}
+	} else if (init_needle(self, pattern)) {
+		free(self->needle);
+		free(self->trigrams);
+		free(self);
+		return NULL;
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+
+	ret = scan_sync(self, sbuf);
+	if (ret < 0) {
+		mt_search_free(self);
+		return NULL;
+	}
+
+	if (ret || !self->blk_cnt) {
+		self->done = 1;
+		return self;
+	}
+
+	if (pthread_create(&self->thread, NULL, worker, self))
+		worker(self);
+	else
+		self->thread_running = 1;
+
+	return self;
+}
+
+int mt_search_done(struct mt_search *self)
+{
+	int ret;
+
+	pthread_mutex_lock(&self->lock);
+	ret = self->done;
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+size_t mt_search_match_cnt(struct mt_search *self)
+{
+	size_t ret;
+
+	pthread_mutex_lock(&self->lock);
+	ret = self->match_cnt;
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+size_t mt_search_blks_skipped(struct mt_search *self)
+{
+	return __atomic_load_n(&self->blks_skipped, __ATOMIC_RELAXED);
+}
+
+size_t mt_search_matches(struct mt_search *self, struct mt_match *buf,
+                         size_t off, size_t cnt)
+{
+	size_t ret = 0;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (off < self->match_cnt) {
+		ret = MT_MIN(cnt, self->match_cnt - off);
+		memcpy(buf, self->matches + off, ret * sizeof(struct mt_match));
+	}
+
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+void mt_search_free(struct mt_search *self)
+{
+	size_t i;
+
+	if (!self)
+		return;
+
+	__atomic_store_n(&self->cancel, 1, __ATOMIC_RELEASE);
+
+	if (self->thread_running)
+		pthread_join(self->thread, NULL);
+
+	for (i = 0; i < self->blk_cnt; i++)
+		mt_hist_blk_put(self->blks[i]);
+
+	if (self->flags & MT_SEARCH_REGEX)
+		regfree(&self->re);
+
+	pthread_mutex_destroy(&self->lock);
+
+	free(self->blks);
+	free(self->needle);
+	free(self->trigrams);
+	free(self->text.buf);
+	free(self->text.line_start);
+	free(self->matches);
+	free(self);
+}
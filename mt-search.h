@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_SEARCH__
+#define MT_SEARCH__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "mt-common.h"
+
+struct mt_sbuf;
+
+/*
+ * Match position, line is an absolute line number as used by the history,
+ * col is an offset into the logical line.
+ *
+ * Use mt_sbuf_line_to_screen() to map matches to the screen.
+ */
+struct mt_match {
+	uint64_t line;
+	uint32_t col;
+	uint32_t len;
+};
+
+enum mt_search_flags {
+	/* Pattern is POSIX extended regular expression */
+	MT_SEARCH_REGEX = 0x01,
+	/* Ignore case */
+	MT_SEARCH_ICASE = 0x02,
+};
+
+/* Search stops once we collected this many matches */
+#define MT_SEARCH_MAX_MATCHES 65536
+
+struct mt_search;
+
+/*
+ * Starts a search over the screen and the history.
+ *
+ * The screen and the history block that is being filled are searched before
+ * this function returns, the rest of the history is searched in a worker
+ * thread so that the caller can continue parsing and modifying the sbuf.
+ *
+ * Matches are reported for the screen first and then for the history from the
+ * newest block to the oldest one, matches in a block are ordered from top to
+ * bottom.
+ *
+ * Returns NULL on failure, e.g. invalid regular expression.
+ */
+struct mt_search *mt_search_start(struct mt_sbuf *sbuf, const char *pattern,
+                                  enum mt_search_flags flags);
+
+/*
+ * Returns non-zero once the search has finished.
+ */
+int mt_search_done(struct mt_search *self);
+
+/*
+ * Copies up to cnt matches starting at off into the buf.
+ *
+ * Returns number of matches copied.
+ */
+size_t mt_search_matches(struct mt_search *self, struct mt_match *buf,
+                         size_t off, size_t cnt);
+
+/*
+ * Returns number of matches found so far.
+ */
+size_t mt_search_match_cnt(struct mt_search *self);
+
+/*
+ * Returns number of history blocks skipped so far because the trigram index
+ * showed that they cannot match.
+ */
+size_t mt_search_blks_skipped(struct mt_search *self);
+
+/*
+ * Stops the search and frees all resources.
+ */
+void mt_search_free(struct mt_search *self);
+
+#endif /* MT_SEARCH__ */
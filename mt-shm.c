@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mt-common.h"
+#include "mt-shm.h"
+
+#define SHM_ALIGN 64
+/* Reader retries before it starts to sleep and before it gives up */
+#define SHM_SPINS 100
+#define SHM_RETRIES 1000
+#define SHM_SLEEP_US 100
+
+static size_t align(size_t size)
+{
+	return (size + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+}
+
+static size_t srow_size(size_t rows)
+{
+	return align(rows * sizeof(struct mt_row));
+}
+
+static size_t slot_size(size_t rows, size_t cells)
+{
+	return srow_size(rows) + align(cells * sizeof(struct mt_char));
+}
+
+static size_t map_size(size_t rows, size_t cells)
+{
+	return align(sizeof(struct mt_shm_hdr)) + 2 * slot_size(rows, cells);
+}
+
+static struct mt_row *slot_srow(struct mt_shm *self, int slot)
+{
+	return (void *)((char *)self->hdr + align(sizeof(struct mt_shm_hdr)) +
+	                slot * slot_size(self->rows_cap, self->cells_cap));
+}
+
+static struct mt_char *slot_cells(struct mt_shm *self, int slot)
+{
+	return (void *)((char *)slot_srow(self, slot) + srow_size(self->rows_cap));
+}
+
+static int live_slot(struct mt_shm *self, struct mt_sbuf *sbuf)
+{
+	return sbuf->srow == slot_srow(self, 1);
+}
+
+/*
+ * Grows the mapping, the live grid is moved into the first slot.
+ */
+static int grow(struct mt_shm *self, struct mt_sbuf *sbuf, size_t rows, size_t cells)
+{
+	size_t old_size = self->hdr->size, size = map_size(rows, cells);
+	size_t live_rows = sbuf->srow ? sbuf->rows : 0;
+	size_t live_cells = live_rows * sbuf->cols;
+	struct mt_char *tmp_cells = NULL;
+	struct mt_row *tmp_srow = NULL;
+	void *map;
+
+	/* Live grid may move, slot offsets depend on capacity */
+	if (live_rows) {
+		tmp_cells = malloc(live_cells * sizeof(struct mt_char));
+		tmp_srow = malloc(live_rows * sizeof(struct mt_row));
+
+		if (!tmp_cells || !tmp_srow)
+			goto err;
+
+		memcpy(tmp_cells, sbuf->sbuf, live_cells * sizeof(struct mt_char));
+		memcpy(tmp_srow, sbuf->srow, live_rows * sizeof(struct mt_row));
+	}
+
+	if (ftruncate(self->fd, size))
+		goto err;
+
+	map = mremap(self->hdr, old_size, size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		goto err;
+
+	self->hdr = map;
+	self->hdr->size = size;
+	self->rows_cap = rows;
+	self->cells_cap = cells;
+
+	if (live_rows) {
+		memcpy(slot_cells(self, 0), tmp_cells, live_cells * sizeof(struct mt_char));
+		memcpy(slot_srow(self, 0), tmp_srow, live_rows * sizeof(struct mt_row));
+
+		sbuf->sbuf = slot_cells(self, 0);
+		sbuf->srow = slot_srow(self, 0);
+		sbuf->sbuf_sz = cells;
+		sbuf->srow_sz = rows;
+	}
+
+	free(tmp_cells);
+	free(tmp_srow);
+
+	return 0;
+err:
+	free(tmp_cells);
+	free(tmp_srow);
+	return 1;
+}
+
+int mt_shm_reserve(struct mt_sbuf *sbuf, size_t cells, size_t rows)
+{
+	struct mt_shm *self = sbuf->shm;
+	int spare;
+
+	if (cells > self->cells_cap || rows > self->rows_cap) {
+		if (grow(self, sbuf, MT_MAX(rows, self->rows_cap), MT_MAX(cells, self->cells_cap)))
+			return 1;
+	}
+
+	spare = !live_slot(self, sbuf);
+
+	sbuf->spare_sbuf = slot_cells(self, spare);
+	sbuf->spare_srow = slot_srow(self, spare);
+	sbuf->spare_sbuf_sz = self->cells_cap;
+	sbuf->spare_srow_sz = self->rows_cap;
+
+	return 0;
+}
+
+void mt_shm_publish(struct mt_sbuf *sbuf)
+{
+	struct mt_shm_hdr *hdr = sbuf->shm->hdr;
+
+	hdr->cols = sbuf->cols;
+	hdr->rows = sbuf->rows;
+	hdr->cur_col = sbuf->cur_col;
+	hdr->cur_row = sbuf->cur_row;
+	hdr->sbuf_off = sbuf->sbuf_off;
+	hdr->flags = sbuf->cursor_hidden ? MT_SHM_CURSOR_HIDDEN : 0;
+
+	if (sbuf->srow) {
+		hdr->srow_off = (char *)sbuf->srow - (char *)hdr;
+		hdr->grid_off = (char *)sbuf->sbuf - (char *)hdr;
+	}
+
+	hdr->generation++;
+
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int create(const char *name)
+{
+	if (name[0] == '/')
+		return shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+	return memfd_create(name, MFD_CLOEXEC);
+}
+
+int mt_shm_export(struct mt_sbuf *sbuf, const char *name)
+{
+	struct mt_shm *self;
+	size_t size = map_size(0, 0);
+	struct mt_char *old_sbuf = sbuf->sbuf, *old_spare_sbuf = sbuf->spare_sbuf;
+	struct mt_row *old_srow = sbuf->srow, *old_spare_srow = sbuf->spare_srow;
+
+	self = calloc(1, sizeof(*self));
+	if (!self)
+		return 1;
+
+	if (name[0] == '/') {
+		self->name = strdup(name);
+		if (!self->name)
+			goto err0;
+	}
+
+	self->fd = create(name);
+	if (self->fd < 0)
+		goto err0;
+
+	if (ftruncate(self->fd, size))
+		goto err1;
+
+	self->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+	if (self->hdr == MAP_FAILED)
+		goto err1;
+
+	memcpy(self->hdr->magic, MT_SHM_MAGIC, 4);
+	self->hdr->version = MT_SHM_VERSION;
+	self->hdr->size = size;
+
+	sbuf->shm = self;
+
+	mt_shm_begin(sbuf);
+
+	if (grow(self, sbuf, sbuf->rows, (size_t)sbuf->rows * sbuf->cols)) {
+		mt_shm_end(sbuf);
+		sbuf->shm = NULL;
+		munmap(self->hdr, self->hdr->size);
+		goto err1;
+	}
+
+	/* The grid was copied into the mapping */
+	free(old_sbuf);
+	free(old_srow);
+	free(old_spare_sbuf);
+	free(old_spare_srow);
+
+	sbuf->spare_sbuf = NULL;
+	sbuf->spare_srow = NULL;
+	sbuf->spare_sbuf_sz = 0;
+	sbuf->spare_srow_sz = 0;
+
+	mt_shm_end(sbuf);
+
+	return 0;
+err1:
+	close(self->fd);
+	if (self->name)
+		shm_unlink(self->name);
+err0:
+	free(self->name);
+	free(self);
+	return 1;
+}
+
+void mt_shm_free(struct mt_shm *self)
+{
+	if (!self)
+		return;
+
+	munmap(self->hdr, self->hdr->size);
+	close(self->fd);
+
+	if (self->name)
+		shm_unlink(self->name);
+
+	free(self->name);
+	free(self);
+}
+
+int mt_shm_reader_open(struct mt_shm_reader *self, const char *name)
+{
+	struct mt_shm_hdr *hdr;
+
+	memset(self, 0, sizeof(*self));
+
+	if (name[0] == '/' && !strchr(name + 1, '/'))
+		self->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	else
+		self->fd = open(name, O_RDONLY | O_CLOEXEC);
+
+	if (self->fd < 0)
+		return 1;
+
+	self->size = sizeof(struct mt_shm_hdr);
+
+	self->map = mmap(NULL, self->size, PROT_READ, MAP_SHARED, self->fd, 0);
+	if (self->map == MAP_FAILED)
+		goto err;
+
+	hdr = self->map;
+
+	if (memcmp(hdr->magic, MT_SHM_MAGIC, 4) || hdr->version != MT_SHM_VERSION) {
+		munmap(self->map, self->size);
+		errno = EINVAL;
+		goto err;
+	}
+
+	return 0;
+err:
+	close(self->fd);
+	self->fd = -1;
+	return 1;
+}
+
+void mt_shm_reader_close(struct mt_shm_reader *self)
+{
+	if (self->fd < 0)
+		return;
+
+	munmap(self->map, self->size);
+	close(self->fd);
+	self->fd = -1;
+}
+
+static int remap(struct mt_shm_reader *self, size_t size)
+{
+	void *map = mremap(self->map, self->size, size, MREMAP_MAYMOVE);
+
+	if (map == MAP_FAILED)
+		return 1;
+
+	self->map = map;
+	self->size = size;
+
+	return 0;
+}
+
+static void copy_rows(const struct mt_shm_hdr *hdr, const char *map,
+                      struct mt_char *cells)
+{
+	const struct mt_row *srow = (const void *)(map + hdr->srow_off);
+	const struct mt_char *grid = (const void *)(map + hdr->grid_off);
+	uint32_t row, col;
+
+	for (row = 0; row < hdr->rows; row++) {
+		uint32_t idx = (row + hdr->sbuf_off) % hdr->rows;
+		struct mt_char *dst = cells + (size_t)row * hdr->cols;
+
+		if (srow[idx].blank) {
+			for (col = 0; col < hdr->cols; col++)
+				dst[col] = srow[idx].blank_char;
+			continue;
+		}
+
+		memcpy(dst, grid + (size_t)idx * hdr->cols, hdr->cols * sizeof(struct mt_char));
+	}
+}
+
+static int range_ok(uint64_t off, uint64_t len, size_t align, size_t size)
+{
+	return !(off % align) && off <= size && len <= size - off;
+}
+
+/*
+ * The header may change under the reader at any time, hence it's validated
+ * on a copy and only the copy is used to access the mapping.
+ */
+static int hdr_ok(const struct mt_shm_hdr *hdr, size_t size)
+{
+	uint64_t cells = (uint64_t)hdr->rows * hdr->cols;
+
+	if (!hdr->rows)
+		return 1;
+
+	if (hdr->sbuf_off >= hdr->rows)
+		return 0;
+
+	return range_ok(hdr->srow_off, hdr->rows * sizeof(struct mt_row),
+	                _Alignof(struct mt_row), size) &&
+	       range_ok(hdr->grid_off, cells * sizeof(struct mt_char),
+	                _Alignof(struct mt_char), size);
+}
+
+/*
+ * A writer that crashed or was stopped in the middle of an update must not
+ * hang the readers, hence after a few quick retries the reader sleeps and
+ * eventually gives up.
+ */
+static int retry(unsigned int *tries)
+{
+	if (++*tries < SHM_SPINS)
+		return 1;
+
+	if (*tries >= SHM_SPINS + SHM_RETRIES) {
+		errno = EAGAIN;
+		return 0;
+	}
+
+	usleep(SHM_SLEEP_US);
+	return 1;
+}
+
+int mt_shm_read(struct mt_shm_reader *self, struct mt_shm_frame *frame,
+                struct mt_char *cells, size_t cells_cnt)
+{
+	struct mt_shm_hdr *live, hdr;
+	unsigned int tries = 0;
+	uint32_t seq;
+	int ret;
+
+	for (;;) {
+		live = self->map;
+
+		seq = __atomic_load_n(&live->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			if (!retry(&tries))
+				return -1;
+			continue;
+		}
+
+		memcpy(&hdr, live, sizeof(hdr));
+
+		frame->generation = hdr.generation;
+		frame->cols = hdr.cols;
+		frame->rows = hdr.rows;
+		frame->cur_col = hdr.cur_col;
+		frame->cur_row = hdr.cur_row;
+		frame->flags = hdr.flags;
+
+		ret = 0;
+
+		if (hdr.size > self->size)
+			ret = 2;
+		else if ((uint64_t)hdr.rows * hdr.cols > cells_cnt)
+			ret = 1;
+		else if (!hdr_ok(&hdr, self->size))
+			ret = -1;
+		else if (hdr.rows)
+			copy_rows(&hdr, self->map, cells);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&live->seq, __ATOMIC_RELAXED) != seq) {
+			if (!retry(&tries))
+				return -1;
+			continue;
+		}
+
+		if (ret == 2) {
+			if (remap(self, hdr.size))
+				return -1;
+			continue;
+		}
+
+		if (ret < 0)
+			errno = EINVAL;
+
+		return ret;
+	}
+}
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_SHM__
+#define MT_SHM__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "mt-sbuf.h"
+
+/*
+ * Shared memory export of the visible grid.
+ *
+ * Once exported the sbuf grid lives in a shared mapping, i.e. the writer does
+ * not copy anything, the parser only bumps a sequence counter around each
+ * mt_parse() call. The mapping starts with a header followed by two slots,
+ * the live grid and the spare grid used by mt_sbuf_resize().
+ *
+ * Readers use the seqlock protocol, the sequence is odd while the grid is
+ * being modified and the data are consistent only if the sequence was even
+ * and did not change while they were read, see mt_shm_read().
+ *
+ * The grid is a ring of rows starting at sbuf_off, rows marked blank in the
+ * row table are filled with their blank_char, see mt_sbuf_row_idx().
+ */
+#define MT_SHM_MAGIC "MTSH"
+#define MT_SHM_VERSION 1
+
+#define MT_SHM_CURSOR_HIDDEN 0x01
+
+struct mt_shm_hdr {
+	char magic[4];
+	uint32_t version;
+	/* Odd while the writer modifies the mapping */
+	uint32_t seq;
+	uint32_t flags;
+	/* Incremented on each update */
+	uint64_t generation;
+	/* Size of the mapping, it only grows */
+	uint64_t size;
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t cur_col;
+	uint32_t cur_row;
+	/* Index of the first screen row */
+	uint32_t sbuf_off;
+	uint32_t reserved;
+	/* Offsets of the live row table and cells, zero if there is no grid */
+	uint64_t srow_off;
+	uint64_t grid_off;
+};
+
+/*
+ * Writer side, owned by the sbuf.
+ */
+struct mt_shm {
+	int fd;
+	/* Set for shm_open() names, unlinked on exit */
+	char *name;
+	struct mt_shm_hdr *hdr;
+	size_t rows_cap;
+	size_t cells_cap;
+};
+
+/*
+ * Moves the sbuf grid into a shared mapping.
+ *
+ * Names starting with '/' are created with shm_open(), otherwise the name is
+ * passed to memfd_create() and readers get the descriptor from mt_shm_fd().
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_shm_export(struct mt_sbuf *sbuf, const char *name);
+
+static inline int mt_shm_fd(struct mt_sbuf *sbuf)
+{
+	return sbuf->shm ? sbuf->shm->fd : -1;
+}
+
+/*
+ * Unmaps the mapping, called from mt_sbuf_free().
+ */
+void mt_shm_free(struct mt_shm *self);
+
+/*
+ * Points the sbuf spare grid to the spare slot, grows the mapping if needed.
+ *
+ * Called from mt_sbuf_resize().
+ */
+int mt_shm_reserve(struct mt_sbuf *sbuf, size_t cells, size_t rows);
+
+/*
+ * Writer seqlock, everything that modifies the grid has to be enclosed in
+ * mt_shm_begin() and mt_shm_end().
+ */
+static inline void mt_shm_begin(struct mt_sbuf *sbuf)
+{
+	struct mt_shm_hdr *hdr;
+
+	if (!sbuf->shm)
+		return;
+
+	hdr = sbuf->shm->hdr;
+
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void mt_shm_publish(struct mt_sbuf *sbuf);
+
+static inline void mt_shm_end(struct mt_sbuf *sbuf)
+{
+	if (sbuf->shm)
+		mt_shm_publish(sbuf);
+}
+
+/*
+ * Reader side.
+ */
+struct mt_shm_reader {
+	int fd;
+	void *map;
+	size_t size;
+};
+
+struct mt_shm_frame {
+	uint64_t generation;
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t cur_col;
+	uint32_t cur_row;
+	uint32_t flags;
+};
+
+/*
+ * Maps an exported grid, names starting with '/' with no other slash are
+ * opened with shm_open(), anything else is a path, e.g. /proc/$PID/fd/$FD
+ * for a memfd.
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_shm_reader_open(struct mt_shm_reader *self, const char *name);
+
+void mt_shm_reader_close(struct mt_shm_reader *self);
+
+/*
+ * Copies a consistent frame, rows are stored one after another starting with
+ * the top row.
+ *
+ * Returns zero on success, 1 if cells_cnt is smaller than the grid, the frame
+ * is filled in so that the caller can retry with a bigger buffer and -1 on
+ * failure with errno set, EINVAL if the header is not consistent with the
+ * mapping and EAGAIN if the writer did not finish an update in time, e.g.
+ * because it was stopped.
+ */
+int mt_shm_read(struct mt_shm_reader *self, struct mt_shm_frame *frame,
+                struct mt_char *cells, size_t cells_cnt);
+
+#endif /* MT_SHM__ */
@@ -0,0 +1,481 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mt-common.h"
+#include "mt-sbuf.h"
+#include "mt-screen.h"
+#include "mt-parser.h"
+#include "mt-shm.h"
+#include "mt-snap.h"
+
+#define SNAP_ALIGN 8
+
+enum snap_flags {
+	SNAP_CURSOR_HIDDEN = 0x01,
+	SNAP_AUTOWRAP = 0x02,
+	SNAP_HIST_OPEN = 0x04,
+	SNAP_BRACKETED_PASTE = 0x08,
+	SNAP_PAR_T = 0x10,
+};
+
+struct snap_hdr {
+	char magic[4];
+	uint16_t version;
+	/* Snapshots with a different cell layout are rejected */
+	uint16_t char_size;
+	uint16_t row_size;
+	uint16_t flags;
+
+	/* sbuf */
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t cur_col;
+	uint32_t cur_row;
+	char charset[2];
+	uint8_t sel_charset;
+	struct mt_char cur_char;
+
+	/* parser */
+	uint8_t fg_col;
+	uint8_t bg_col;
+	char last_gchar;
+	char csi_intermediate;
+	uint8_t par_cnt;
+	uint32_t state;
+	uint16_t pars[MT_MAX_CSI_PARS];
+
+	/* history */
+	uint64_t hist_first;
+	uint64_t hist_max_lines;
+	uint64_t blk_cnt;
+
+	/* Row table followed by the cells, the first screen row goes first */
+	uint64_t grid_off;
+	/* Table of struct snap_blk */
+	uint64_t blks_off;
+};
+
+struct snap_blk {
+	uint64_t first;
+	/* File offsets of the line offsets and cells */
+	uint64_t line_off;
+	uint64_t cells;
+	uint32_t line_cnt;
+	uint32_t cells_used;
+	uint32_t sealed;
+	uint32_t reserved;
+	uint64_t idx[MT_HIST_IDX_BITS/64];
+};
+
+static uint64_t align(uint64_t off)
+{
+	return (off + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+}
+
+struct writer {
+	FILE *f;
+	uint64_t off;
+	int err;
+};
+
+static void put(struct writer *w, const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, w->f) != 1)
+		w->err = 1;
+
+	w->off += len;
+}
+
+static void pad(struct writer *w)
+{
+	static const char zeros[SNAP_ALIGN];
+
+	put(w, zeros, align(w->off) - w->off);
+}
+
+static void save_hdr(struct mt_parser *parser, struct snap_hdr *hdr)
+{
+	struct mt_sbuf *sbuf = parser->sbuf;
+	struct mt_hist *hist = &sbuf->hist;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	memcpy(hdr->magic, MT_SNAP_MAGIC, 4);
+	hdr->version = MT_SNAP_VERSION;
+	hdr->char_size = sizeof(struct mt_char);
+	hdr->row_size = sizeof(struct mt_row);
+
+	if (sbuf->cursor_hidden)
+		hdr->flags |= SNAP_CURSOR_HIDDEN;
+	if (sbuf->autowrap)
+		hdr->flags |= SNAP_AUTOWRAP;
+	if (hist->open)
+		hdr->flags |= SNAP_HIST_OPEN;
+	if (parser->bracketed_paste)
+		hdr->flags |= SNAP_BRACKETED_PASTE;
+	if (parser->par_t)
+		hdr->flags |= SNAP_PAR_T;
+
+	hdr->cols = sbuf->cols;
+	hdr->rows = sbuf->rows;
+	hdr->cur_col = sbuf->cur_col;
+	hdr->cur_row = sbuf->cur_row;
+	memcpy(hdr->charset, sbuf->charset, 2);
+	hdr->sel_charset = sbuf->sel_charset;
+	hdr->cur_char = sbuf->cur_char;
+
+	hdr->fg_col = parser->fg_col;
+	hdr->bg_col = parser->bg_col;
+	hdr->last_gchar = parser->last_gchar;
+	hdr->csi_intermediate = parser->csi_intermediate;
+	hdr->par_cnt = parser->par_cnt;
+	hdr->state = parser->state;
+	memcpy(hdr->pars, parser->pars, sizeof(hdr->pars));
+
+	hdr->hist_first = hist->first;
+	hdr->hist_max_lines = hist->max_lines;
+	hdr->blk_cnt = hist->blk_cnt;
+}
+
+static void save_grid(struct writer *w, struct mt_sbuf *sbuf)
+{
+	mt_coord row;
+
+	for (row = 0; row < sbuf->rows; row++)
+		put(w, &sbuf->srow[mt_sbuf_row_idx(sbuf, row)], sizeof(struct mt_row));
+
+	pad(w);
+
+	/* Blank rows are saved as they are and filled once modified */
+	for (row = 0; row < sbuf->rows; row++) {
+		put(w, &sbuf->sbuf[mt_sbuf_row_idx(sbuf, row) * sbuf->cols],
+		    sbuf->cols * sizeof(struct mt_char));
+	}
+}
+
+static void save_blk(struct writer *w, struct mt_hist_blk *blk, struct snap_blk *sblk)
+{
+	sblk->first = blk->first;
+	sblk->line_cnt = blk->line_cnt;
+	sblk->cells_used = blk->cells_used;
+	sblk->sealed = blk->sealed;
+
+	/* Block without the index matches anything */
+	if (blk->idx)
+		memcpy(sblk->idx, blk->idx, sizeof(sblk->idx));
+	else
+		memset(sblk->idx, 0xff, sizeof(sblk->idx));
+
+	pad(w);
+	sblk->line_off = w->off;
+	put(w, blk->line_off, (blk->line_cnt + 1) * sizeof(uint32_t));
+
+	pad(w);
+	sblk->cells = w->off;
+	put(w, blk->cells, blk->cells_used * sizeof(struct mt_char));
+}
+
+int mt_snap_save(struct mt_parser *parser, const char *path)
+{
+	struct mt_hist *hist = &parser->sbuf->hist;
+	struct writer w = {};
+	struct snap_hdr hdr;
+	struct snap_blk *blks;
+	char *tmp;
+	size_t i;
+	int fd, err;
+
+	tmp = malloc(strlen(path) + 5);
+	blks = calloc(MT_MAX(hist->blk_cnt, (size_t)1), sizeof(struct snap_blk));
+	if (!tmp || !blks)
+		goto err0;
+
+	sprintf(tmp, "%s.tmp", path);
+
+	/* The snapshot contains the whole screen and history */
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto err0;
+
+	w.f = fdopen(fd, "w");
+	if (!w.f) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		goto err0;
+	}
+
+	save_hdr(parser, &hdr);
+	put(&w, &hdr, sizeof(hdr));
+
+	pad(&w);
+	hdr.grid_off = w.off;
+	save_grid(&w, parser->sbuf);
+
+	for (i = 0; i < hist->blk_cnt; i++)
+		save_blk(&w, hist->blks[i], &blks[i]);
+
+	pad(&w);
+	hdr.blks_off = w.off;
+	put(&w, blks, hist->blk_cnt * sizeof(struct snap_blk));
+
+	/* Header with the offsets filled in */
+	if (fseek(w.f, 0, SEEK_SET))
+		w.err = 1;
+
+	put(&w, &hdr, sizeof(hdr));
+
+	if (w.err || fflush(w.f) || fsync(fileno(w.f)))
+		goto err1;
+
+	if (fclose(w.f)) {
+		w.f = NULL;
+		goto err1;
+	}
+
+	if (rename(tmp, path)) {
+		w.f = NULL;
+		goto err1;
+	}
+
+	free(blks);
+	free(tmp);
+	return 0;
+err1:
+	err = errno;
+	if (w.f)
+		fclose(w.f);
+	unlink(tmp);
+	errno = err;
+err0:
+	free(blks);
+	free(tmp);
+	return 1;
+}
+
+static int in_file(const struct mt_hist_map *map, uint64_t off, uint64_t len)
+{
+	return !(off % SNAP_ALIGN) && off <= map->size && len <= map->size - off;
+}
+
+/*
+ * Line offsets have to start at zero, grow and end at cells_used, otherwise
+ * the history would read past the block cells.
+ */
+static int check_lines(const struct mt_hist_map *map, const struct snap_blk *blk)
+{
+	const uint32_t *line_off = (const void *)((const char *)map->addr + blk->line_off);
+	uint32_t i;
+
+	if (line_off[0] || line_off[blk->line_cnt] != blk->cells_used)
+		return 1;
+
+	for (i = 0; i < blk->line_cnt; i++) {
+		if (line_off[i] > line_off[i+1])
+			return 1;
+	}
+
+	return 0;
+}
+
+static int check(const struct mt_hist_map *map)
+{
+	const struct snap_hdr *hdr = map->addr;
+	const struct snap_blk *blks;
+	uint64_t i, grid_size;
+
+	if (memcmp(hdr->magic, MT_SNAP_MAGIC, 4) || hdr->version != MT_SNAP_VERSION ||
+	    hdr->char_size != sizeof(struct mt_char) || hdr->row_size != sizeof(struct mt_row))
+		return 1;
+
+	if (!hdr->cols || !hdr->rows || hdr->cols > UINT16_MAX || hdr->rows > UINT16_MAX ||
+	    hdr->cur_col >= hdr->cols || hdr->cur_row >= hdr->rows)
+		return 1;
+
+	grid_size = align(hdr->rows * sizeof(struct mt_row)) +
+	            (uint64_t)hdr->rows * hdr->cols * sizeof(struct mt_char);
+
+	if (!in_file(map, hdr->grid_off, grid_size))
+		return 1;
+
+	if (hdr->blk_cnt > map->size / sizeof(struct snap_blk) ||
+	    !in_file(map, hdr->blks_off, hdr->blk_cnt * sizeof(struct snap_blk)))
+		return 1;
+
+	blks = (const void *)((const char *)map->addr + hdr->blks_off);
+
+	for (i = 0; i < hdr->blk_cnt; i++) {
+		if (!in_file(map, blks[i].line_off, ((uint64_t)blks[i].line_cnt + 1) * sizeof(uint32_t)) ||
+		    !in_file(map, blks[i].cells, (uint64_t)blks[i].cells_used * sizeof(struct mt_char)))
+			return 1;
+
+		if (check_lines(map, &blks[i]))
+			return 1;
+
+		if (i && blks[i].first != blks[i-1].first + blks[i-1].line_cnt)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void notify_cursor(struct mt_sbuf *sbuf, uint8_t set)
+{
+	struct mt_screen *s;
+
+	if (sbuf->cursor_hidden)
+		return;
+
+	for (s = sbuf->screen; s; s = s->next) {
+		if (s->cursor)
+			s->cursor(s->priv, sbuf->cur_col, sbuf->cur_row, set);
+	}
+}
+
+static void restore_state(struct mt_parser *parser, const struct snap_hdr *hdr)
+{
+	struct mt_sbuf *sbuf = parser->sbuf;
+
+	sbuf->cursor_hidden = !!(hdr->flags & SNAP_CURSOR_HIDDEN);
+	sbuf->autowrap = !!(hdr->flags & SNAP_AUTOWRAP);
+	sbuf->cur_col = hdr->cur_col;
+	sbuf->cur_row = hdr->cur_row;
+	memcpy(sbuf->charset, hdr->charset, 2);
+	sbuf->sel_charset = hdr->sel_charset;
+	sbuf->cur_char = hdr->cur_char;
+
+	parser->bracketed_paste = !!(hdr->flags & SNAP_BRACKETED_PASTE);
+	parser->par_t = !!(hdr->flags & SNAP_PAR_T);
+	parser->fg_col = hdr->fg_col;
+	parser->bg_col = hdr->bg_col;
+	parser->last_gchar = hdr->last_gchar;
+	parser->csi_intermediate = hdr->csi_intermediate;
+	parser->par_cnt = MT_MIN(hdr->par_cnt, (uint8_t)MT_MAX_CSI_PARS);
+	parser->state = hdr->state;
+	memcpy(parser->pars, hdr->pars, sizeof(parser->pars));
+}
+
+static int restore_hist(struct mt_hist *hist, struct mt_hist_map *map)
+{
+	const struct snap_hdr *hdr = map->addr;
+	const char *addr = map->addr;
+	const struct snap_blk *sblk = (const void *)(addr + hdr->blks_off);
+	struct mt_hist_blk blk = {};
+	uint64_t i;
+
+	mt_hist_free(hist);
+
+	hist->first = hdr->hist_first;
+	hist->max_lines = hdr->hist_max_lines;
+
+	for (i = 0; i < hdr->blk_cnt; i++, sblk++) {
+		blk.first = sblk->first;
+		blk.line_cnt = sblk->line_cnt;
+		blk.line_off = (uint32_t *)(addr + sblk->line_off);
+		blk.cells_used = sblk->cells_used;
+		blk.cells = (struct mt_char *)(addr + sblk->cells);
+		blk.sealed = !!sblk->sealed;
+		blk.idx = blk.sealed ? (uint64_t *)sblk->idx : NULL;
+
+		if (mt_hist_restore_blk(hist, map, &blk))
+			return 1;
+	}
+
+	hist->open = hist->lines && (hdr->flags & SNAP_HIST_OPEN);
+
+	return 0;
+}
+
+static int restore(struct mt_parser *parser, struct mt_hist_map *map)
+{
+	const struct snap_hdr *hdr = map->addr;
+	const char *grid = (const char *)map->addr + hdr->grid_off;
+	struct mt_sbuf *sbuf = parser->sbuf;
+	size_t srow_size = hdr->rows * sizeof(struct mt_row);
+	struct mt_screen *s;
+	int ret;
+
+	if (mt_sbuf_resize(sbuf, hdr->cols, hdr->rows))
+		return 1;
+
+	mt_shm_begin(sbuf);
+
+	notify_cursor(sbuf, 0);
+
+	memcpy(sbuf->srow, grid, srow_size);
+	memcpy(sbuf->sbuf, grid + align(srow_size),
+	       (size_t)hdr->rows * hdr->cols * sizeof(struct mt_char));
+	sbuf->sbuf_off = 0;
+
+	restore_state(parser, hdr);
+
+	ret = restore_hist(&sbuf->hist, map);
+
+	mt_shm_end(sbuf);
+
+	for (s = sbuf->screen; s; s = s->next) {
+		if (s->damage)
+			s->damage(s->priv, 0, 0, sbuf->cols, sbuf->rows);
+	}
+
+	notify_cursor(sbuf, 1);
+
+	return ret;
+}
+
+int mt_snap_load(struct mt_parser *parser, const char *path)
+{
+	struct mt_hist_map *map;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &st))
+		goto err0;
+
+	if ((size_t)st.st_size < sizeof(struct snap_hdr)) {
+		errno = EINVAL;
+		goto err0;
+	}
+
+	map = malloc(sizeof(*map));
+	if (!map)
+		goto err0;
+
+	map->size = st.st_size;
+	map->refs = 1;
+	map->addr = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map->addr == MAP_FAILED)
+		goto err1;
+
+	close(fd);
+
+	if (check(map)) {
+		mt_hist_map_put(map);
+		errno = EINVAL;
+		return 1;
+	}
+
+	ret = restore(parser, map);
+
+	/* Blocks that point into the mapping hold their own references */
+	mt_hist_map_put(map);
+
+	return ret;
+err1:
+	free(map);
+err0:
+	close(fd);
+	return 1;
+}
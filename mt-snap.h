@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_SNAP__
+#define MT_SNAP__
+
+#include <stdint.h>
+
+struct mt_parser;
+
+/*
+ * Terminal state snapshots.
+ *
+ * A snapshot is a single file in native byte order, a header with the sbuf
+ * and parser state is followed by the screen rows, the history blocks and a
+ * table of the blocks.
+ *
+ * The file is mapped on restore and sealed history blocks point into the
+ * mapping, so restoring takes time proportional to the number of blocks
+ * rather than to their size and pages are read on the first access.
+ */
+#define MT_SNAP_MAGIC "MTSN"
+#define MT_SNAP_VERSION 1
+
+/*
+ * Writes the parser and its sbuf state into a file, the file is written under
+ * a temporary name and renamed, so an existing snapshot is replaced
+ * atomically.
+ *
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+int mt_snap_save(struct mt_parser *parser, const char *path);
+
+/*
+ * Restores the parser and its sbuf state from a file.
+ *
+ * The sbuf is resized to the size stored in the snapshot, the history is
+ * replaced. Attached screens are notified about the whole screen change.
+ *
+ * Returns zero on success, non-zero on failure with errno set, in that case
+ * the state is unchanged unless the failure happened while the history was
+ * restored, then the history is partial.
+ */
+int mt_snap_load(struct mt_parser *parser, const char *path);
+
+#endif /* MT_SNAP__ */
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include "mt-stats.h"
+
+__thread struct mt_stats mt_stats;
+
+static const char *stat_names[MT_STAT_CNT] = {
+	[MT_STAT_BYTES] = "bytes",
+	[MT_STAT_CHARS] = "chars",
+	[MT_STAT_CTRL] = "ctrl",
+	[MT_STAT_ESC] = "esc",
+	[MT_STAT_CSI] = "csi",
+	[MT_STAT_OSC] = "osc",
+	[MT_STAT_DCS] = "dcs",
+	[MT_STAT_SCROLL_LINES] = "scroll_lines",
+	[MT_STAT_DAMAGE_CELLS] = "damage_cells",
+	[MT_STAT_CELLS_DRAWN] = "cells_drawn",
+	[MT_STAT_UPDATES_QUEUED] = "updates_queued",
+	[MT_STAT_UPDATES] = "updates",
+	[MT_STAT_FLIPS] = "flips",
+	[MT_STAT_FRAMES] = "frames",
+	[MT_STAT_FRAMES_SKIPPED] = "frames_skipped",
+	[MT_STAT_FF_FRAMES] = "ff_frames",
+	[MT_STAT_READS] = "reads",
+	[MT_STAT_IOCTLS] = "ioctls",
+	[MT_STAT_WRITES] = "writes",
+	[MT_STAT_URING_ENTERS] = "uring_enters",
+	[MT_STAT_ECHO_FRAMES] = "echo_frames",
+	[MT_STAT_ECHO_BULK] = "echo_bulk",
+};
+
+const char *mt_stat_name(enum mt_stat stat)
+{
+	if (stat >= MT_STAT_CNT)
+		return "???";
+
+	return stat_names[stat];
+}
+
+void mt_stats_dump(const struct mt_stats *self, FILE *f)
+{
+	unsigned int i;
+
+	uint64_t syscalls = self->cnt[MT_STAT_READS] + self->cnt[MT_STAT_IOCTLS] +
+	                    self->cnt[MT_STAT_URING_ENTERS];
+	uint64_t bytes = self->cnt[MT_STAT_BYTES];
+
+	for (i = 0; i < MT_STAT_CNT; i++)
+		fprintf(f, "%-14s %llu\n", mt_stat_name(i), (unsigned long long)self->cnt[i]);
+
+	if (bytes)
+		fprintf(f, "%-14s %.1f\n", "syscalls/MB", 1048576.0 * syscalls / bytes);
+
+	fflush(f);
+}
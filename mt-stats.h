@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_STATS__
+#define MT_STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hot path statistics.
+ *
+ * Counters are per-thread and unsynchronised so that they can be left on in
+ * production, incrementing one is a single add to thread local storage.
+ */
+enum mt_stat {
+	/* Bytes passed to mt_parse() */
+	MT_STAT_BYTES,
+	/* Printable characters */
+	MT_STAT_CHARS,
+	/* Control characters */
+	MT_STAT_CTRL,
+	/* ESC sequences that are not CSI, OSC or DCS */
+	MT_STAT_ESC,
+	MT_STAT_CSI,
+	MT_STAT_OSC,
+	MT_STAT_DCS,
+	/* Lines scrolled in the screen buffer */
+	MT_STAT_SCROLL_LINES,
+	/* Cells in the damaged rectangles */
+	MT_STAT_DAMAGE_CELLS,
+	/* Cells repainted by the renderer */
+	MT_STAT_CELLS_DRAWN,
+	/* Rectangles queued for update, merged before they are pushed */
+	MT_STAT_UPDATES_QUEUED,
+	/* Backend update rect calls */
+	MT_STAT_UPDATES,
+	/* Backend flips */
+	MT_STAT_FLIPS,
+	/* Renderer passes that painted anything */
+	MT_STAT_FRAMES,
+	/* Frames skipped while flooded with output */
+	MT_STAT_FRAMES_SKIPPED,
+	/* Full repaints after the screen scrolled away */
+	MT_STAT_FF_FRAMES,
+	/* PTY read() syscalls */
+	MT_STAT_READS,
+	/* FIONREAD ioctl() syscalls */
+	MT_STAT_IOCTLS,
+	/* PTY write() syscalls */
+	MT_STAT_WRITES,
+	/* io_uring_enter() syscalls */
+	MT_STAT_URING_ENTERS,
+	/* Frames rendered early on a small response to input */
+	MT_STAT_ECHO_FRAMES,
+	/* Responses to input that were too big for the echo fast path */
+	MT_STAT_ECHO_BULK,
+	MT_STAT_CNT,
+};
+
+struct mt_stats {
+	uint64_t cnt[MT_STAT_CNT];
+};
+
+extern __thread struct mt_stats mt_stats;
+
+static inline void mt_stat_add(enum mt_stat stat, uint64_t val)
+{
+	mt_stats.cnt[stat] += val;
+}
+
+static inline void mt_stat_inc(enum mt_stat stat)
+{
+	mt_stats.cnt[stat]++;
+}
+
+/*
+ * Returns counter name.
+ */
+const char *mt_stat_name(enum mt_stat stat);
+
+/*
+ * Prints all counters, one per line, followed by PTY syscalls per MB parsed.
+ */
+void mt_stats_dump(const struct mt_stats *self, FILE *f);
+
+#endif /* MT_STATS__ */
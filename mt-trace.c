@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "mt-trace.h"
+
+int mt_trace_enabled;
+
+struct ring {
+	struct ring *next;
+	pid_t tid;
+	uint64_t pos;
+	struct mt_trace_event events[MT_TRACE_EVENTS];
+};
+
+static __thread struct ring *ring;
+
+/* All allocated rings, rings are never freed */
+static struct ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[MT_TRACE_CNT] = {
+	[MT_TRACE_READ] = "read",
+	[MT_TRACE_PARSE] = "parse",
+	[MT_TRACE_SCROLL] = "scroll",
+	[MT_TRACE_DAMAGE] = "damage",
+	[MT_TRACE_UPDATE] = "update_rect",
+	[MT_TRACE_FLIP] = "flip",
+};
+
+uint64_t mt_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mt_trace_enable(void)
+{
+	mt_trace_enabled = 1;
+}
+
+static struct ring *ring_alloc(void)
+{
+	struct ring *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return NULL;
+
+	self->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&rings_lock);
+	self->next = rings;
+	rings = self;
+	pthread_mutex_unlock(&rings_lock);
+
+	return self;
+}
+
+void mt_trace_record(enum mt_trace_phase phase, uint64_t begin, uint64_t end, uint32_t arg)
+{
+	struct mt_trace_event *ev;
+
+	if (!ring) {
+		ring = ring_alloc();
+		if (!ring) {
+			mt_trace_enabled = 0;
+			return;
+		}
+	}
+
+	ev = &ring->events[ring->pos++ & (MT_TRACE_EVENTS - 1)];
+
+	ev->ts = begin;
+	ev->dur = end - begin;
+	ev->phase = phase;
+	ev->arg = arg;
+}
+
+static void dump_ring(struct ring *self, FILE *f, pid_t pid, int *first)
+{
+	uint64_t pos = self->pos;
+	uint64_t i = pos > MT_TRACE_EVENTS ? pos - MT_TRACE_EVENTS : 0;
+
+	for (; i < pos; i++) {
+		struct mt_trace_event *ev = &self->events[i & (MT_TRACE_EVENTS - 1)];
+
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%i,\"tid\":%i,"
+		        "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"n\":%u}}",
+		        *first ? "" : ",", phase_names[ev->phase], (int)pid, (int)self->tid,
+		        (unsigned long long)(ev->ts / 1000), (unsigned int)(ev->ts % 1000),
+		        (unsigned long long)(ev->dur / 1000), (unsigned int)(ev->dur % 1000),
+		        ev->arg);
+
+		*first = 0;
+	}
+}
+
+int mt_trace_dump(FILE *f)
+{
+	struct ring *i;
+	pid_t pid = getpid();
+	int first = 1;
+
+	fprintf(f, "{\"traceEvents\":[");
+
+	pthread_mutex_lock(&rings_lock);
+	for (i = rings; i; i = i->next)
+		dump_ring(i, f, pid, &first);
+	pthread_mutex_unlock(&rings_lock);
+
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	return fflush(f) || ferror(f);
+}
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_TRACE__
+#define MT_TRACE__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Phase tracer.
+ *
+ * When enabled, begin and end timestamps of the phases are recorded into a
+ * per-thread ring buffer that can be dumped as Chrome trace-event JSON and
+ * loaded into a trace viewer. When disabled, the cost is a single branch.
+ */
+enum mt_trace_phase {
+	/* PTY read() */
+	MT_TRACE_READ,
+	/* mt_parse() batch */
+	MT_TRACE_PARSE,
+	/* Scroll blit */
+	MT_TRACE_SCROLL,
+	/* Damage repaint */
+	MT_TRACE_DAMAGE,
+	/* Backend update rect */
+	MT_TRACE_UPDATE,
+	/* Backend flip */
+	MT_TRACE_FLIP,
+	MT_TRACE_CNT,
+};
+
+/* Events in per-thread ring, has to be power of two */
+#define MT_TRACE_EVENTS 65536
+
+struct mt_trace_event {
+	uint64_t ts;
+	/* Nanoseconds, 32 bits would wrap after 4.29s */
+	uint64_t dur;
+	uint16_t phase;
+	/* Phase specific, e.g. number of bytes */
+	uint32_t arg;
+};
+
+extern int mt_trace_enabled;
+
+uint64_t mt_trace_now(void);
+
+void mt_trace_record(enum mt_trace_phase phase, uint64_t begin, uint64_t end, uint32_t arg);
+
+/*
+ * Returns a timestamp to be passed to mt_trace_end() or 0 if tracing is
+ * disabled.
+ */
+static inline uint64_t mt_trace_begin(void)
+{
+	if (!mt_trace_enabled)
+		return 0;
+
+	return mt_trace_now();
+}
+
+static inline void mt_trace_end(enum mt_trace_phase phase, uint64_t begin, uint32_t arg)
+{
+	if (!begin)
+		return;
+
+	mt_trace_record(phase, begin, mt_trace_now(), arg);
+}
+
+/*
+ * Enables tracing, the rings are allocated lazily on the first event in each
+ * thread.
+ */
+void mt_trace_enable(void);
+
+/*
+ * Writes events from all threads as Chrome trace-event JSON.
+ *
+ * Events recorded concurrently by other threads may be lost.
+ *
+ * Returns zero on success, non-zero on a write error.
+ */
+int mt_trace_dump(FILE *f);
+
+#endif /* MT_TRACE__ */
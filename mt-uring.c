@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "mt-common.h"
+#include "mt-stats.h"
+#include "mt-trace.h"
+#include "mt-uring.h"
+
+#define URING_ENTRIES 4
+#define PROBE_OPS 64
+
+enum op {
+	OP_READ = 1,
+	OP_WRITE,
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	               min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int op_supported(struct io_uring_probe *probe, uint8_t op)
+{
+	return op <= probe->last_op && op < probe->ops_len &&
+	       (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/*
+ * IORING_OP_READ and IORING_OP_WRITE were added in 5.6 along with the probe,
+ * older kernels fail the probe.
+ */
+static int ops_supported(int fd)
+{
+	struct io_uring_probe *probe;
+	int ret = 0;
+
+	probe = calloc(1, sizeof(*probe) + PROBE_OPS * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return 0;
+
+	if (!uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS))
+		ret = op_supported(probe, IORING_OP_READ) && op_supported(probe, IORING_OP_WRITE);
+
+	free(probe);
+
+	return ret;
+}
+
+static void unmap(struct mt_uring *self)
+{
+	if (self->sqes)
+		munmap(self->sqes, self->sqes_sz);
+
+	if (self->cq_ptr && self->cq_ptr != self->sq_ptr)
+		munmap(self->cq_ptr, self->cq_sz);
+
+	if (self->sq_ptr)
+		munmap(self->sq_ptr, self->sq_sz);
+}
+
+int mt_uring_init(struct mt_uring *self, int pty_fd, struct mt_ring *in)
+{
+	struct io_uring_params p;
+	int flags;
+
+	memset(self, 0, sizeof(*self));
+	memset(&p, 0, sizeof(p));
+
+	self->fd = uring_setup(URING_ENTRIES, &p);
+	if (self->fd < 0)
+		return 1;
+
+	if (!ops_supported(self->fd))
+		goto err;
+
+	self->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	self->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	self->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		self->sq_sz = self->cq_sz = MT_MAX(self->sq_sz, self->cq_sz);
+
+	self->sq_ptr = mmap(NULL, self->sq_sz, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+	if (self->sq_ptr == MAP_FAILED) {
+		self->sq_ptr = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		self->cq_ptr = self->sq_ptr;
+	} else {
+		self->cq_ptr = mmap(NULL, self->cq_sz, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_CQ_RING);
+		if (self->cq_ptr == MAP_FAILED) {
+			self->cq_ptr = NULL;
+			goto err;
+		}
+	}
+
+	self->sqes = mmap(NULL, self->sqes_sz, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQES);
+	if (self->sqes == MAP_FAILED) {
+		self->sqes = NULL;
+		goto err;
+	}
+
+	self->sq_head = self->sq_ptr + p.sq_off.head;
+	self->sq_tail = self->sq_ptr + p.sq_off.tail;
+	self->sq_array = self->sq_ptr + p.sq_off.array;
+	self->sq_mask = *(unsigned int *)(self->sq_ptr + p.sq_off.ring_mask);
+	self->sq_entries = p.sq_entries;
+	self->sq_local_tail = *self->sq_tail;
+
+	self->cq_head = self->cq_ptr + p.cq_off.head;
+	self->cq_tail = self->cq_ptr + p.cq_off.tail;
+	self->cq_mask = *(unsigned int *)(self->cq_ptr + p.cq_off.ring_mask);
+	self->cqes = self->cq_ptr + p.cq_off.cqes;
+
+	self->pty_fd = pty_fd;
+	self->in = in;
+
+	/*
+	 * Operations on O_NONBLOCK files fail with EAGAIN instead of waiting
+	 * for data, the requests are asynchronous anyway.
+	 */
+	flags = fcntl(pty_fd, F_GETFL, 0);
+	fcntl(pty_fd, F_SETFL, flags & ~O_NONBLOCK);
+	self->pty_flags = flags;
+
+	return 0;
+err:
+	unmap(self);
+	close(self->fd);
+	self->fd = -1;
+	return 1;
+}
+
+void mt_uring_exit(struct mt_uring *self)
+{
+	if (self->fd < 0)
+		return;
+
+	unmap(self);
+	close(self->fd);
+	self->fd = -1;
+
+	fcntl(self->pty_fd, F_SETFL, self->pty_flags);
+
+	mt_wqueue_free(&self->out);
+	mt_wqueue_free(&self->out_flight);
+}
+
+static struct io_uring_sqe *get_sqe(struct mt_uring *self)
+{
+	unsigned int head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int idx = self->sq_local_tail & self->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (self->sq_local_tail - head >= self->sq_entries)
+		return NULL;
+
+	sqe = &self->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	self->sq_array[idx] = idx;
+	self->sq_local_tail++;
+	self->to_submit++;
+
+	return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, uint8_t opcode, int fd,
+                    void *buf, size_t len, enum op op)
+{
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	/* Offset -1 means current file position, i.e. for a PTY just read/write */
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = op;
+}
+
+static void queue_read(struct mt_uring *self)
+{
+	struct mt_ring *in = self->in;
+	size_t off = in->head & (in->size - 1);
+	size_t len = MT_MIN(mt_ring_free_space(in), in->size - off);
+	struct io_uring_sqe *sqe;
+
+	if (self->read_pending || !len)
+		return;
+
+	sqe = get_sqe(self);
+	if (!sqe)
+		return;
+
+	prep_rw(sqe, IORING_OP_READ, self->pty_fd, in->buf + off, len, OP_READ);
+	self->read_pos = in->head;
+	self->read_len = len;
+	self->read_pending = 1;
+}
+
+static void queue_write(struct mt_uring *self)
+{
+	struct mt_wqueue tmp;
+	struct io_uring_sqe *sqe;
+
+	if (self->write_pending)
+		return;
+
+	if (!mt_wqueue_pending(&self->out_flight)) {
+		if (!mt_wqueue_pending(&self->out))
+			return;
+
+		tmp = self->out_flight;
+		self->out_flight = self->out;
+		self->out = tmp;
+		self->out.off = self->out.len = 0;
+	}
+
+	sqe = get_sqe(self);
+	if (!sqe)
+		return;
+
+	prep_rw(sqe, IORING_OP_WRITE, self->pty_fd,
+	        self->out_flight.buf + self->out_flight.off,
+	        mt_wqueue_pending(&self->out_flight), OP_WRITE);
+	self->write_pending = 1;
+}
+
+int mt_uring_write(struct mt_uring *self, const char *buf, size_t len)
+{
+	return mt_wqueue_add(&self->out, buf, len);
+}
+
+static ssize_t complete_read(struct mt_uring *self, int res)
+{
+	struct mt_ring *in = self->in;
+
+	self->read_pending = 0;
+	self->read_full = 0;
+
+	/* The kernel has io_uring but the operation is not supported */
+	if (res == -EINVAL || res == -EOPNOTSUPP) {
+		self->read_err = EOPNOTSUPP;
+		return 0;
+	}
+
+	if (res < 0) {
+		if (res != -EAGAIN && res != -EINTR)
+			self->read_err = -res;
+		return 0;
+	}
+
+	self->read_full = (size_t)res == self->read_len;
+
+	/*
+	 * The ring was drained and rewound while the read was in flight,
+	 * nothing else writes into the ring so it's still empty.
+	 */
+	if (in->head != self->read_pos)
+		in->head = in->tail = self->read_pos;
+
+	in->head += res;
+
+	return res;
+}
+
+static void complete_write(struct mt_uring *self, int res)
+{
+	struct mt_wqueue *out = &self->out_flight;
+
+	self->write_pending = 0;
+
+	/* EAGAIN and EINTR are retried, anything else drops the data */
+	if (res < 0) {
+		if (res != -EAGAIN && res != -EINTR)
+			out->off = out->len = 0;
+		return;
+	}
+
+	out->off += res;
+
+	if (out->off == out->len)
+		out->off = out->len = 0;
+}
+
+ssize_t mt_uring_run(struct mt_uring *self, int wait)
+{
+	unsigned int head, tail;
+	ssize_t ret = 0;
+	uint64_t trace;
+
+	queue_write(self);
+	queue_read(self);
+
+	if (self->to_submit || wait) {
+		__atomic_store_n(self->sq_tail, self->sq_local_tail, __ATOMIC_RELEASE);
+
+		trace = mt_trace_begin();
+		if (uring_enter(self->fd, self->to_submit, !!wait) >= 0)
+			self->to_submit = 0;
+		mt_trace_end(MT_TRACE_READ, trace, 0);
+
+		mt_stat_inc(MT_STAT_URING_ENTERS);
+	}
+
+	head = *self->cq_head;
+	tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &self->cqes[head & self->cq_mask];
+
+		switch (cqe->user_data) {
+		case OP_READ:
+			ret += complete_read(self, cqe->res);
+		break;
+		case OP_WRITE:
+			complete_write(self, cqe->res);
+		break;
+		}
+	}
+
+	__atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+
+	if (!ret && self->read_err) {
+		errno = self->read_err;
+		return -1;
+	}
+
+	return ret;
+}
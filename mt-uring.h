@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_URING__
+#define MT_URING__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "mt-ring.h"
+#include "mt-wqueue.h"
+
+/*
+ * PTY I/O over io_uring.
+ *
+ * A read into the free space of the input ring is kept in flight all the
+ * time and data written to the PTY are queued and written by a single write
+ * in flight. Each call to mt_uring_run() submits and reaps with at most one
+ * io_uring_enter() syscall, completions are reaped from the shared memory.
+ */
+struct mt_uring {
+	int fd;
+	int pty_fd;
+
+	/* Submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_sz;
+	size_t cq_sz;
+	size_t sqes_sz;
+
+	/* PTY file flags before init, restored on exit */
+	int pty_flags;
+
+	struct mt_ring *in;
+	/* Ring position and size of the read in flight */
+	size_t read_pos;
+	size_t read_len;
+	uint8_t read_pending:1;
+	uint8_t write_pending:1;
+	/* The last read filled the buffer, more data is likely pending */
+	uint8_t read_full:1;
+
+	/* Error from a completed read, reported by mt_uring_run() */
+	int read_err;
+
+	/*
+	 * Data queued for writing and data being written, the buffers are
+	 * swapped when the write in flight finishes.
+	 */
+	struct mt_wqueue out;
+	struct mt_wqueue out_flight;
+};
+
+/*
+ * Sets up io_uring for the PTY file descriptor, reads go into the in ring.
+ *
+ * Returns zero on success, non-zero if io_uring or the read and write
+ * operations are not available, in that case the caller should use plain
+ * read() and write().
+ *
+ * The PTY is switched to blocking mode while io_uring is used.
+ */
+int mt_uring_init(struct mt_uring *self, int pty_fd, struct mt_ring *in);
+
+/*
+ * Tears down the io_uring and restores the PTY file flags, data queued for
+ * writing are dropped.
+ */
+void mt_uring_exit(struct mt_uring *self);
+
+/*
+ * Queues data to be written to the PTY.
+ *
+ * Returns zero on success, non-zero on allocation failure.
+ */
+int mt_uring_write(struct mt_uring *self, const char *buf, size_t len);
+
+/*
+ * Returns number of bytes queued or in flight that were not written yet.
+ */
+static inline size_t mt_uring_pending(struct mt_uring *self)
+{
+	return mt_wqueue_pending(&self->out) + mt_wqueue_pending(&self->out_flight);
+}
+
+/*
+ * Submits queued reads and writes and reaps completions, if wait is set
+ * blocks until at least one request completes.
+ *
+ * Returns number of bytes added to the input ring, -1 if a read failed with
+ * errno set. EOPNOTSUPP means that the kernel can't read the PTY over
+ * io_uring, the caller should fall back to read() and write() after
+ * mt_uring_exit().
+ */
+ssize_t mt_uring_run(struct mt_uring *self, int wait);
+
+#endif /* MT_URING__ */
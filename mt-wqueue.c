@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mt-common.h"
+#include "mt-stats.h"
+#include "mt-wqueue.h"
+
+int mt_wqueue_add(struct mt_wqueue *self, const char *buf, size_t len)
+{
+	size_t pending = mt_wqueue_pending(self);
+
+	if (self->len + len > self->size && self->off) {
+		memmove(self->buf, self->buf + self->off, pending);
+		self->off = 0;
+		self->len = pending;
+	}
+
+	if (self->len + len > self->size) {
+		size_t size = MT_MAX(2 * self->size, self->len + len);
+		char *new_buf = realloc(self->buf, size);
+
+		if (!new_buf)
+			return 1;
+
+		self->buf = new_buf;
+		self->size = size;
+	}
+
+	memcpy(self->buf + self->len, buf, len);
+	self->len += len;
+
+	return 0;
+}
+
+ssize_t mt_wqueue_flush(struct mt_wqueue *self, int fd)
+{
+	ssize_t ret;
+
+	if (!mt_wqueue_pending(self))
+		return 0;
+
+	ret = write(fd, self->buf + self->off, mt_wqueue_pending(self));
+
+	mt_stat_inc(MT_STAT_WRITES);
+
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+
+		return -1;
+	}
+
+	self->off += ret;
+
+	if (self->off == self->len)
+		self->off = self->len = 0;
+
+	return ret;
+}
+
+void mt_wqueue_free(struct mt_wqueue *self)
+{
+	free(self->buf);
+	memset(self, 0, sizeof(*self));
+}
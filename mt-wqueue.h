@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+#ifndef MT_WQUEUE__
+#define MT_WQUEUE__
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/*
+ * Outgoing byte queue.
+ *
+ * Key sequences and parser responses are appended to the queue and written
+ * to a non-blocking file descriptor in a single write(), bytes that were not
+ * written stay in the queue for the next flush.
+ */
+struct mt_wqueue {
+	char *buf;
+	/* Start of the data not written yet */
+	size_t off;
+	/* End of the data */
+	size_t len;
+	size_t size;
+};
+
+static inline size_t mt_wqueue_pending(struct mt_wqueue *self)
+{
+	return self->len - self->off;
+}
+
+/*
+ * Appends data to the queue.
+ *
+ * Returns zero on success, non-zero on allocation failure.
+ */
+int mt_wqueue_add(struct mt_wqueue *self, const char *buf, size_t len);
+
+/*
+ * Writes as much of the queue as possible with a single write().
+ *
+ * Returns number of bytes written, 0 if nothing was written because the fd
+ * is not writable and -1 on error with errno set.
+ */
+ssize_t mt_wqueue_flush(struct mt_wqueue *self, int fd);
+
+void mt_wqueue_free(struct mt_wqueue *self);
+
+#endif /* MT_WQUEUE__ */
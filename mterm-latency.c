@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Keypress to screen update latency driver.
+ *
+ * Runs an echo stand-in for the shell on a PTY, sends it keys, parses the
+ * echo and measures the time until the first screen damage, i.e. everything
+ * mterm does for a keypress except for the actual drawing.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include "mt-common.h"
+#include "mt-screen.h"
+#include "mt-sbuf.h"
+#include "mt-parser.h"
+#include "mt-latency.h"
+#include "mt-ring.h"
+#include "mt-uring.h"
+
+static void echo_loop(void)
+{
+	char buf[1024];
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(0, buf, sizeof(buf));
+		if (ret <= 0)
+			exit(0);
+
+		if (write(1, buf, ret) != ret)
+			exit(1);
+	}
+}
+
+static int run_echo(void)
+{
+	struct termios t;
+	int fd, pid;
+
+	cfmakeraw(&t);
+
+	pid = forkpty(&fd, NULL, &t, NULL);
+	if (pid < 0) {
+		fprintf(stderr, "Fork failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (pid == 0)
+		echo_loop();
+
+	return fd;
+}
+
+static int damaged;
+
+static void damage(void *priv, mt_coord s_col, mt_coord s_row, mt_coord e_col, mt_coord e_row)
+{
+	(void)priv; (void)s_col; (void)s_row; (void)e_col; (void)e_row;
+	damaged = 1;
+}
+
+static void scroll(void *priv, int lines)
+{
+	(void)priv; (void)lines;
+	damaged = 1;
+}
+
+static struct mt_screen screen = {
+	.damage = damage,
+	.scroll = scroll,
+};
+
+static struct mt_ring input;
+static struct mt_uring uring;
+static int use_uring;
+
+static void key_uring(struct mt_parser *parser, char c)
+{
+	const char *span;
+	size_t len;
+
+	mt_uring_write(&uring, &c, 1);
+
+	while (!damaged) {
+		if (mt_uring_run(&uring, 1) < 0) {
+			fprintf(stderr, "Read failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		while ((span = mt_ring_span(&input, &len))) {
+			mt_parse(parser, span, len);
+			mt_ring_consume(&input, len);
+		}
+	}
+}
+
+static void key(int fd, struct mt_parser *parser, struct mt_latency *lat, char c)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	char buf[1024];
+	ssize_t ret;
+
+	damaged = 0;
+
+	mt_latency_key(lat, mt_latency_now());
+
+	if (use_uring) {
+		key_uring(parser, c);
+		goto done;
+	}
+
+	if (write(fd, &c, 1) != 1) {
+		fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	while (!damaged) {
+		if (poll(&pfd, 1, 1000) <= 0) {
+			fprintf(stderr, "No echo for '%c'\n", c);
+			exit(1);
+		}
+
+		ret = read(fd, buf, sizeof(buf));
+		if (ret <= 0) {
+			fprintf(stderr, "Read failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		mt_parse(parser, buf, ret);
+	}
+
+done:
+	mt_latency_frame(lat, mt_latency_now());
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-u] [-n keys] [-d delay_us] [-m max_p99_us]\n", name);
+	fprintf(stderr, "  -u use io_uring for PTY I/O\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct mt_latency lat;
+	struct mt_parser parser;
+	struct mt_sbuf *sbuf;
+	unsigned int i, keys = 1000, delay = 1000, max_p99 = 0;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "un:d:m:")) != -1) {
+		switch (opt) {
+		case 'u':
+			use_uring = 1;
+		break;
+		case 'n':
+			keys = atoi(optarg);
+		break;
+		case 'd':
+			delay = atoi(optarg);
+		break;
+		case 'm':
+			max_p99 = atoi(optarg);
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	sbuf = mt_sbuf_alloc();
+	if (!sbuf)
+		MT_ERROR_MALLOC;
+
+	if (mt_sbuf_resize(sbuf, 80, 25))
+		MT_ERROR_MALLOC;
+
+	mt_sbuf_screen_add(sbuf, &screen);
+
+	mt_parser_init(&parser, sbuf, 7, 0);
+
+	fd = run_echo();
+
+	if (use_uring) {
+		if (mt_ring_init(&input, 64 * 1024))
+			MT_ERROR_MALLOC;
+
+		if (mt_uring_init(&uring, fd, &input)) {
+			fprintf(stderr, "io_uring not available\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < keys; i++) {
+		key(fd, &parser, &lat, 'a' + i % 26);
+
+		if (delay)
+			usleep(delay);
+	}
+
+	if (use_uring) {
+		mt_uring_exit(&uring);
+		mt_ring_free(&input);
+	}
+
+	close(fd);
+	mt_sbuf_free(sbuf);
+
+	mt_latency_dump(&lat, stdout);
+
+	if (max_p99 && mt_latency_percentile(&lat, 99) > max_p99) {
+		fprintf(stderr, "p99 latency over %uus!\n", max_p99);
+		return 1;
+	}
+
+	return 0;
+}
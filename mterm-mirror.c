@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Screen delta protocol client.
+ *
+ * Connects to a mirror socket, applies the frames to a local copy of the
+ * screen and prints it once no frame arrived for the timeout or the server
+ * disconnected. With -v the operations are printed as they are applied.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mt-common.h"
+#include "mt-delta.h"
+
+static struct {
+	unsigned int cols;
+	unsigned int rows;
+	unsigned int cur_col;
+	unsigned int cur_row;
+	uint8_t cur_flags;
+	char *chars;
+} screen;
+
+static unsigned int frames;
+static int verbose;
+
+static int read_all(int fd, void *buf, size_t len, int timeout)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		if (poll(&pfd, 1, timeout) <= 0)
+			return 1;
+
+		ret = read(fd, p, len);
+		if (ret <= 0)
+			return 1;
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static uint16_t get_u16(const uint8_t **p)
+{
+	uint16_t ret = (*p)[0] | (*p)[1] << 8;
+
+	*p += 2;
+
+	return ret;
+}
+
+static void clear_rows(unsigned int s_row, unsigned int e_row)
+{
+	memset(screen.chars + s_row * screen.cols, ' ', (e_row - s_row) * screen.cols);
+}
+
+static void keyframe(const uint8_t **p)
+{
+	screen.cols = get_u16(p);
+	screen.rows = get_u16(p);
+
+	if (verbose)
+		printf("  keyframe %ux%u\n", screen.cols, screen.rows);
+
+	screen.chars = realloc(screen.chars, screen.cols * screen.rows);
+	if (!screen.chars)
+		MT_ERROR_MALLOC;
+
+	clear_rows(0, screen.rows);
+}
+
+static int scroll(const uint8_t **p)
+{
+	int lines = (int16_t)get_u16(p);
+	unsigned int n = abs(lines);
+	char *c = screen.chars;
+	size_t moved;
+
+	if (verbose)
+		printf("  scroll %i\n", lines);
+
+	if (n >= screen.rows)
+		return 1;
+
+	moved = (screen.rows - n) * screen.cols;
+
+	if (lines > 0) {
+		memmove(c, c + n * screen.cols, moved);
+		clear_rows(screen.rows - n, screen.rows);
+	} else {
+		memmove(c + n * screen.cols, c, moved);
+		clear_rows(0, n);
+	}
+
+	return 0;
+}
+
+static int row(const uint8_t **p, const uint8_t *end)
+{
+	unsigned int r = get_u16(p);
+	unsigned int col = get_u16(p);
+	unsigned int runs = get_u16(p);
+	unsigned int len;
+
+	if (verbose)
+		printf("  row %u col %u runs %u\n", r, col, runs);
+
+	while (runs--) {
+		if (end - *p < 3)
+			return 1;
+
+		len = get_u16(p);
+		/* Attributes are ignored */
+		(*p)++;
+
+		if (end - *p < len || r >= screen.rows || col + len > screen.cols)
+			return 1;
+
+		memcpy(screen.chars + r * screen.cols + col, *p, len);
+		*p += len;
+		col += len;
+	}
+
+	return 0;
+}
+
+/* Operation sizes without the runs */
+static const uint8_t op_sizes[] = {
+	[MT_DELTA_KEYFRAME] = 4,
+	[MT_DELTA_SCROLL] = 2,
+	[MT_DELTA_ROW] = 6,
+	[MT_DELTA_CURSOR] = 5,
+};
+
+static int apply(const uint8_t *p, const uint8_t *end)
+{
+	while (p < end) {
+		if (*p >= sizeof(op_sizes) || !op_sizes[*p]) {
+			fprintf(stderr, "Invalid op 0x%02x\n", *p);
+			return 1;
+		}
+
+		if (end - p - 1 < op_sizes[*p])
+			return 1;
+
+		switch (*p++) {
+		case MT_DELTA_KEYFRAME:
+			keyframe(&p);
+		break;
+		case MT_DELTA_SCROLL:
+			if (scroll(&p))
+				return 1;
+		break;
+		case MT_DELTA_ROW:
+			if (row(&p, end))
+				return 1;
+		break;
+		case MT_DELTA_CURSOR:
+			screen.cur_col = get_u16(&p);
+			screen.cur_row = get_u16(&p);
+			screen.cur_flags = *p++;
+
+			if (verbose)
+				printf("  cursor %ux%u\n", screen.cur_row, screen.cur_col);
+		break;
+		}
+	}
+
+	return 0;
+}
+
+static void dump(void)
+{
+	unsigned int r;
+
+	printf("Frames: %u\n", frames);
+
+	for (r = 0; r < screen.rows; r++)
+		printf("|%.*s|\n", (int)screen.cols, screen.chars + r * screen.cols);
+
+	printf("size %ux%u cursor %ux%u%s\n", screen.rows, screen.cols,
+	       screen.cur_row, screen.cur_col,
+	       screen.cur_flags & MT_DELTA_CURSOR_VISIBLE ? "" : " hidden");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-v] [-t timeout_ms] socket\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	uint8_t hello[MT_DELTA_HELLO_SIZE], len_buf[4];
+	uint8_t *buf = NULL;
+	uint32_t len;
+	int opt, fd, timeout = 500;
+
+	while ((opt = getopt(argc, argv, "t:v")) != -1) {
+		switch (opt) {
+		case 't':
+			timeout = atoi(optarg);
+		break;
+		case 'v':
+			verbose = 1;
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc || strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	strcpy(addr.sun_path, argv[optind]);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Can't connect to '%s': %s\n", addr.sun_path, strerror(errno));
+		return 1;
+	}
+
+	if (read_all(fd, hello, sizeof(hello), timeout) ||
+	    memcmp(hello, MT_DELTA_MAGIC, 4) || hello[4] != MT_DELTA_VERSION) {
+		fprintf(stderr, "Invalid hello\n");
+		return 1;
+	}
+
+	while (!read_all(fd, len_buf, 4, timeout)) {
+		len = len_buf[0] | len_buf[1] << 8 | len_buf[2] << 16 | (uint32_t)len_buf[3] << 24;
+
+		if (verbose)
+			printf("Frame %u:\n", frames + 1);
+
+		buf = realloc(buf, len);
+		if (len && !buf)
+			MT_ERROR_MALLOC;
+
+		if (read_all(fd, buf, len, timeout) || apply(buf, buf + len)) {
+			fprintf(stderr, "Invalid frame\n");
+			return 1;
+		}
+
+		frames++;
+	}
+
+	dump();
+
+	free(buf);
+	free(screen.chars);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,820 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Headless terminal server.
+ *
+ * Hosts many PTY sessions in a single process, each session has its own
+ * parser and screen buffer. The sessions are processed by a pool of worker
+ * threads, one per core by default.
+ *
+ * The main thread waits for readable PTYs with epoll and pushes the sessions
+ * into the run queue of their home worker. Each worker takes sessions from
+ * the head of its own queue and once it runs out of work it steals from the
+ * tail of the other queues. A session is processed for at most SESSION_BUDGET
+ * bytes, if there is more data it's put back at the end of the queue, so a
+ * flooding session gets its share but cannot starve the rest.
+ *
+ * The PTYs are registered with EPOLLONESHOT and rearmed only once drained,
+ * hence a session is queued at most once and never processed by two workers
+ * at the same time. Parser responses are queued and written by the worker
+ * after parsing, if the PTY is full the session waits for EPOLLOUT as well.
+ *
+ * With -m each session serves screen deltas on a Unix socket in the given
+ * directory. The mirrors are run by the main thread every MT_MIRROR_FRAME_MS,
+ * sessions that are being parsed are skipped until the next round.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <pty.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "mt-common.h"
+#include "mt-sbuf.h"
+#include "mt-parser.h"
+#include "mt-stats.h"
+#include "mt-ring.h"
+#include "mt-wqueue.h"
+#include "mt-mirror.h"
+#include "mt-shm.h"
+#include "mt-snap.h"
+
+#define SESSION_RING_SIZE (64 * 1024)
+#define SESSION_BUDGET (64 * 1024)
+#define EPOLL_EVENTS 64
+#define REAP_TIMEOUT_MS 1000
+
+struct session {
+	unsigned int id;
+	/* Worker whose queue the session is pushed to when it becomes ready */
+	unsigned int home;
+	int fd;
+	pid_t pid;
+	int status;
+	uint8_t exited:1;
+	/* The PTY was hung up, the application closed it or is exiting */
+	uint8_t hangup:1;
+	uint64_t bytes;
+
+	struct mt_parser parser;
+	struct mt_sbuf *sbuf;
+	struct mt_ring in;
+	/* Parser responses not written yet */
+	struct mt_wqueue out;
+
+	/* Held while parsing, the mirror reads the sbuf from the main thread */
+	pthread_mutex_t lock;
+	struct mt_mirror mirror;
+	uint8_t mirrored:1;
+	/* Client waiting on the mirror socket, main thread only */
+	uint8_t accept:1;
+};
+
+/*
+ * Each session is queued at most once, so a queue sized to the number of
+ * sessions never overflows.
+ */
+struct run_queue {
+	pthread_mutex_t lock;
+	struct session **sessions;
+	unsigned int head;
+	unsigned int cnt;
+	unsigned int size;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	struct run_queue queue;
+
+	/* Number of sessions processed and how many of them were stolen */
+	uint64_t runs;
+	uint64_t stolen;
+	uint64_t bytes;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Sessions in all run queues not claimed by a worker yet */
+	unsigned int queued;
+	/* Sessions whose PTY was not hung up yet */
+	unsigned int live;
+	int quit;
+	int epfd;
+	/* Mirror sockets, polled by the main thread */
+	int mirror_epfd;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct session *sessions;
+static unsigned int session_cnt = 1;
+
+static struct worker *workers;
+static unsigned int worker_cnt;
+
+static int verbose;
+
+static volatile sig_atomic_t quit_req;
+
+static void run_queue_init(struct run_queue *self, unsigned int size)
+{
+	pthread_mutex_init(&self->lock, NULL);
+
+	self->sessions = malloc(size * sizeof(*self->sessions));
+	if (!self->sessions)
+		MT_ERROR_MALLOC;
+
+	self->head = 0;
+	self->cnt = 0;
+	self->size = size;
+}
+
+static void run_queue_push(struct run_queue *self, struct session *session)
+{
+	pthread_mutex_lock(&self->lock);
+	self->sessions[(self->head + self->cnt++) % self->size] = session;
+	pthread_mutex_unlock(&self->lock);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.queued++;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct session *run_queue_pop_head(struct run_queue *self)
+{
+	struct session *ret = NULL;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (self->cnt) {
+		ret = self->sessions[self->head];
+		self->head = (self->head + 1) % self->size;
+		self->cnt--;
+	}
+
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+static struct session *run_queue_pop_tail(struct run_queue *self)
+{
+	struct session *ret = NULL;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (self->cnt)
+		ret = self->sessions[(self->head + --self->cnt) % self->size];
+
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+/*
+ * Waits for a queued session, own queue first then steals from the others.
+ *
+ * Returns NULL when the server is shutting down.
+ */
+static struct session *worker_next(struct worker *self)
+{
+	struct session *ret;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.lock);
+
+	while (!pool.queued && !pool.quit)
+		pthread_cond_wait(&pool.cond, &pool.lock);
+
+	if (pool.quit) {
+		pthread_mutex_unlock(&pool.lock);
+		return NULL;
+	}
+
+	/* Claim one, it's guaranteed to be in one of the queues */
+	pool.queued--;
+
+	pthread_mutex_unlock(&pool.lock);
+
+	for (;;) {
+		ret = run_queue_pop_head(&self->queue);
+		if (ret)
+			return ret;
+
+		for (i = 1; i < worker_cnt; i++) {
+			ret = run_queue_pop_tail(&workers[(self->id + i) % worker_cnt].queue);
+			if (ret) {
+				self->stolen++;
+				return ret;
+			}
+		}
+	}
+}
+
+static void session_rearm(struct session *self)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = self,
+	};
+
+	if (mt_wqueue_pending(&self->out))
+		ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(pool.epfd, EPOLL_CTL_MOD, self->fd, &ev))
+		fprintf(stderr, "Session %u: epoll_ctl() failed: %s\n", self->id, strerror(errno));
+}
+
+/*
+ * The application may still be running after it closed the PTY, it's reaped
+ * by the main thread on exit so that it does not stall the worker.
+ */
+static void session_exit(struct session *self)
+{
+	epoll_ctl(pool.epfd, EPOLL_CTL_DEL, self->fd, NULL);
+
+	self->hangup = 1;
+
+	if (waitpid(self->pid, &self->status, WNOHANG) > 0)
+		self->exited = 1;
+
+	pthread_mutex_lock(&pool.lock);
+
+	if (!--pool.live) {
+		pool.quit = 1;
+		pthread_cond_broadcast(&pool.cond);
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void session_run(struct worker *worker, struct session *self)
+{
+	const char *span;
+	size_t len, done = 0;
+	ssize_t ret;
+
+	worker->runs++;
+
+	pthread_mutex_lock(&self->lock);
+
+	do {
+		ret = mt_ring_fill(&self->in, self->fd);
+		if (ret <= 0)
+			break;
+
+		while ((span = mt_ring_span(&self->in, &len))) {
+			mt_parse(&self->parser, span, len);
+			mt_ring_consume(&self->in, len);
+		}
+
+		done += ret;
+	} while (done < SESSION_BUDGET);
+
+	pthread_mutex_unlock(&self->lock);
+
+	self->bytes += done;
+	worker->bytes += done;
+
+	if (mt_wqueue_flush(&self->out, self->fd) < 0 && errno != EIO)
+		fprintf(stderr, "Session %u: write failed: %s\n", self->id, strerror(errno));
+
+	/* The application exited */
+	if (ret < 0) {
+		if (errno != EIO)
+			fprintf(stderr, "Session %u: read failed: %s\n", self->id, strerror(errno));
+		session_exit(self);
+		return;
+	}
+
+	if (!ret) {
+		session_rearm(self);
+		return;
+	}
+
+	/* Budget exhausted, let the other sessions run first */
+	run_queue_push(&workers[self->home].queue, self);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *self = arg;
+	struct session *session;
+
+	while ((session = worker_next(self)))
+		session_run(self, session);
+
+	if (verbose) {
+		flockfile(stderr);
+		fprintf(stderr, "Worker %u:\n", self->id);
+		mt_stats_dump(&mt_stats, stderr);
+		funlockfile(stderr);
+	}
+
+	return NULL;
+}
+
+static void response(void *priv, const char *str)
+{
+	struct session *self = priv;
+
+	if (mt_wqueue_add(&self->out, str, strlen(str)))
+		fprintf(stderr, "Session %u: response queue allocation failed\n", self->id);
+}
+
+static void session_mirror(struct session *self, const char *dir)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = self,
+	};
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/session-%u", dir, self->id);
+
+	if (mt_mirror_init(&self->mirror, self->sbuf, path)) {
+		fprintf(stderr, "Can't create mirror socket '%s': %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	if (epoll_ctl(pool.mirror_epfd, EPOLL_CTL_ADD, self->mirror.fd, &ev)) {
+		fprintf(stderr, "epoll_ctl() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	self->mirrored = 1;
+}
+
+static void session_shm(struct session *self, const char *prefix)
+{
+	char name[256];
+
+	snprintf(name, sizeof(name), "/%s-%u", prefix, self->id);
+
+	if (mt_shm_export(self->sbuf, name)) {
+		fprintf(stderr, "Can't export grid to '%s': %s\n", name, strerror(errno));
+		exit(1);
+	}
+}
+
+static void snap_path(struct session *self, const char *dir, char *path, size_t size)
+{
+	snprintf(path, size, "%s/session-%u.snap", dir, self->id);
+}
+
+/*
+ * Restores the screen and history saved by the previous instance, the
+ * snapshot is resized to the current terminal size.
+ */
+static void session_restore(struct session *self, const char *dir,
+                            mt_coord cols, mt_coord rows)
+{
+	char path[1024];
+
+	snap_path(self, dir, path, sizeof(path));
+
+	if (mt_snap_load(&self->parser, path)) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Can't restore '%s': %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (mt_sbuf_resize(self->sbuf, cols, rows))
+		MT_ERROR_MALLOC;
+}
+
+static void session_save(struct session *self, const char *dir)
+{
+	char path[1024];
+
+	snap_path(self, dir, path, sizeof(path));
+
+	if (mt_snap_save(&self->parser, path))
+		fprintf(stderr, "Can't save '%s': %s\n", path, strerror(errno));
+}
+
+/*
+ * Settings shared by all sessions.
+ */
+struct session_conf {
+	const char *cmd;
+	unsigned int cols;
+	unsigned int rows;
+	const char *mirror_dir;
+	const char *shm_prefix;
+	const char *snap_dir;
+	size_t hist_lines;
+	/* History memory in MB before it's spilled into $TMPDIR */
+	size_t hist_spill;
+};
+
+static void session_hist(struct session *self, const struct session_conf *conf)
+{
+	const char *dir = getenv("TMPDIR");
+
+	mt_hist_set_limit(&self->sbuf->hist, conf->hist_lines);
+
+	if (!conf->hist_spill)
+		return;
+
+	if (!dir)
+		dir = "/tmp";
+
+	if (mt_hist_set_spill(&self->sbuf->hist, dir, conf->hist_spill << 20)) {
+		fprintf(stderr, "Can't spill history to '%s': %s\n", dir, strerror(errno));
+		exit(1);
+	}
+}
+
+static void session_init(struct session *self, unsigned int id,
+                         const struct session_conf *conf)
+{
+	struct winsize ws = {.ws_col = conf->cols, .ws_row = conf->rows};
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = self,
+	};
+	int flags;
+
+	self->id = id;
+	self->home = id % worker_cnt;
+
+	pthread_mutex_init(&self->lock, NULL);
+
+	self->sbuf = mt_sbuf_alloc();
+	if (!self->sbuf)
+		MT_ERROR_MALLOC;
+
+	if (mt_sbuf_resize(self->sbuf, conf->cols, conf->rows))
+		MT_ERROR_MALLOC;
+
+	if (mt_ring_init(&self->in, SESSION_RING_SIZE))
+		MT_ERROR_MALLOC;
+
+	mt_parser_init(&self->parser, self->sbuf, 7, 0);
+
+	if (conf->snap_dir)
+		session_restore(self, conf->snap_dir, conf->cols, conf->rows);
+
+	/* Snapshot restores its own history limit */
+	session_hist(self, conf);
+
+	if (conf->mirror_dir)
+		session_mirror(self, conf->mirror_dir);
+
+	if (conf->shm_prefix)
+		session_shm(self, conf->shm_prefix);
+
+	self->pid = forkpty(&self->fd, NULL, NULL, &ws);
+	if (self->pid < 0) {
+		fprintf(stderr, "Fork failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (self->pid == 0) {
+		putenv("TERM=xterm");
+		execl("/bin/sh", "sh", "-c", conf->cmd, NULL);
+		_exit(127);
+	}
+
+	self->parser.response = response;
+	self->parser.priv = self;
+
+	flags = fcntl(self->fd, F_GETFL, 0);
+	fcntl(self->fd, F_SETFL, flags | O_NONBLOCK);
+
+	/* Sessions forked later must not keep the PTY open */
+	fcntl(self->fd, F_SETFD, FD_CLOEXEC);
+
+	if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, self->fd, &ev)) {
+		fprintf(stderr, "epoll_ctl() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static uint64_t time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Closing the PTY hangs up the application, which may ignore SIGHUP, so it is
+ * killed if it does not exit in time. An application that already closed the
+ * PTY is given the same time to finish.
+ */
+static void session_reap(struct session *self)
+{
+	uint64_t start = time_ms();
+
+	if (!self->hangup)
+		kill(self->pid, SIGHUP);
+
+	while (!waitpid(self->pid, &self->status, WNOHANG)) {
+		if (time_ms() - start > REAP_TIMEOUT_MS) {
+			kill(self->pid, SIGKILL);
+			waitpid(self->pid, &self->status, 0);
+			break;
+		}
+
+		usleep(1000);
+	}
+
+	self->exited = 1;
+}
+
+static void session_close(struct session *self)
+{
+	close(self->fd);
+
+	if (!self->exited)
+		session_reap(self);
+}
+
+static void session_free(struct session *self)
+{
+	if (self->mirrored)
+		mt_mirror_exit(&self->mirror);
+
+	mt_ring_free(&self->in);
+	mt_wqueue_free(&self->out);
+	mt_sbuf_free(self->sbuf);
+	pthread_mutex_destroy(&self->lock);
+}
+
+static void session_dump(struct session *self)
+{
+	printf("Session %u: ", self->id);
+
+	if (!self->exited)
+		printf("running");
+	else if (WIFEXITED(self->status))
+		printf("exited with %i", WEXITSTATUS(self->status));
+	else if (WIFSIGNALED(self->status))
+		printf("killed by %s", strsignal(WTERMSIG(self->status)));
+
+	printf(", %llu bytes\n", (unsigned long long)self->bytes);
+
+	mt_sbuf_dump_screen(self->sbuf);
+}
+
+static void quit_signal(int sig)
+{
+	(void)sig;
+	quit_req = 1;
+}
+
+/*
+ * Runs mirrors with connected or connecting clients, sessions that are being
+ * parsed are skipped and the changes keep accumulating.
+ */
+static void run_mirrors(void)
+{
+	static uint64_t run_ms;
+	struct epoll_event evs[EPOLL_EVENTS];
+	uint64_t now = time_ms();
+	unsigned int i;
+	int n;
+
+	if (now - run_ms < MT_MIRROR_FRAME_MS)
+		return;
+
+	run_ms = now;
+
+	n = epoll_wait(pool.mirror_epfd, evs, EPOLL_EVENTS, 0);
+
+	while (n-- > 0) {
+		struct session *session = evs[n].data.ptr;
+
+		session->accept = 1;
+	}
+
+	for (i = 0; i < session_cnt; i++) {
+		struct session *session = &sessions[i];
+
+		if (!session->accept && !mt_mirror_clients(&session->mirror))
+			continue;
+
+		if (pthread_mutex_trylock(&session->lock))
+			continue;
+
+		mt_mirror_run(&session->mirror);
+		session->accept = 0;
+
+		pthread_mutex_unlock(&session->lock);
+	}
+}
+
+/*
+ * Waits for readable PTYs and queues the sessions until all applications
+ * exit or we are asked to quit.
+ */
+static void poll_sessions(const char *mirror_dir)
+{
+	struct epoll_event evs[EPOLL_EVENTS];
+	int i, n, timeout = mirror_dir ? MT_MIRROR_FRAME_MS : 100;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+
+		if (quit_req)
+			pool.quit = 1;
+
+		if (pool.quit) {
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.lock);
+			return;
+		}
+
+		pthread_mutex_unlock(&pool.lock);
+
+		n = epoll_wait(pool.epfd, evs, EPOLL_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			struct session *session = evs[i].data.ptr;
+
+			run_queue_push(&workers[session->home].queue, session);
+		}
+
+		if (mirror_dir)
+			run_mirrors();
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n sessions] [-j workers] [-s colsxrows] [-m dir] [-e prefix] [-S dir] [-l lines] [-H MB] [-d] [-v] [-c cmd]\n", name);
+	fprintf(stderr, "  -n number of sessions (default 1)\n");
+	fprintf(stderr, "  -j number of worker threads (default number of cores)\n");
+	fprintf(stderr, "  -s terminal size (default 80x25)\n");
+	fprintf(stderr, "  -m serve screen deltas on dir/session-N sockets\n");
+	fprintf(stderr, "  -e export grids to /prefix-N shared memory objects\n");
+	fprintf(stderr, "  -S restore sessions from dir/session-N.snap and save them on exit\n");
+	fprintf(stderr, "  -l history lines per session (default %u)\n", MT_HIST_LINES);
+	fprintf(stderr, "  -H spill history over MB per session into $TMPDIR\n");
+	fprintf(stderr, "  -d dump session screens on exit\n");
+	fprintf(stderr, "  -v print per worker statistics\n");
+	fprintf(stderr, "  -c command to run in each session (default /bin/sh)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct session_conf conf = {
+		.cmd = "/bin/sh",
+		.cols = 80,
+		.rows = 25,
+		.hist_lines = MT_HIST_LINES,
+	};
+	unsigned int i;
+	int opt, dump = 0;
+	long cores;
+
+	while ((opt = getopt(argc, argv, "n:j:s:m:e:S:l:H:dvc:")) != -1) {
+		switch (opt) {
+		case 'n':
+			session_cnt = atoi(optarg);
+		break;
+		case 'j':
+			worker_cnt = atoi(optarg);
+		break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &conf.cols, &conf.rows) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+		break;
+		case 'm':
+			conf.mirror_dir = optarg;
+		break;
+		case 'e':
+			conf.shm_prefix = optarg;
+		break;
+		case 'S':
+			conf.snap_dir = optarg;
+		break;
+		case 'l':
+			conf.hist_lines = strtoul(optarg, NULL, 0);
+		break;
+		case 'H':
+			conf.hist_spill = strtoul(optarg, NULL, 0);
+		break;
+		case 'd':
+			dump = 1;
+		break;
+		case 'v':
+			verbose = 1;
+		break;
+		case 'c':
+			conf.cmd = optarg;
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!session_cnt || !conf.cols || !conf.rows) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!worker_cnt) {
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		worker_cnt = cores > 0 ? cores : 1;
+	}
+
+	worker_cnt = MT_MIN(worker_cnt, session_cnt);
+
+	pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pool.epfd < 0) {
+		fprintf(stderr, "epoll_create1() failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	pool.mirror_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pool.mirror_epfd < 0) {
+		fprintf(stderr, "epoll_create1() failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	sessions = calloc(session_cnt, sizeof(*sessions));
+	workers = calloc(worker_cnt, sizeof(*workers));
+	if (!sessions || !workers)
+		MT_ERROR_MALLOC;
+
+	for (i = 0; i < worker_cnt; i++) {
+		workers[i].id = i;
+		run_queue_init(&workers[i].queue, session_cnt);
+	}
+
+	/* Sessions are forked before any thread is started */
+	for (i = 0; i < session_cnt; i++)
+		session_init(&sessions[i], i, &conf);
+
+	pool.live = session_cnt;
+
+	signal(SIGINT, quit_signal);
+	signal(SIGTERM, quit_signal);
+	/* Disconnected mirror clients are handled by write() errors */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < worker_cnt; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+			fprintf(stderr, "Failed to start worker thread\n");
+			return 1;
+		}
+	}
+
+	poll_sessions(conf.mirror_dir);
+
+	for (i = 0; i < worker_cnt; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < session_cnt; i++) {
+		session_close(&sessions[i]);
+
+		if (conf.snap_dir)
+			session_save(&sessions[i], conf.snap_dir);
+
+		if (dump)
+			session_dump(&sessions[i]);
+
+		session_free(&sessions[i]);
+	}
+
+	if (verbose) {
+		for (i = 0; i < worker_cnt; i++) {
+			fprintf(stderr, "Worker %u: %llu runs %llu stolen %llu bytes\n", i,
+			        (unsigned long long)workers[i].runs,
+			        (unsigned long long)workers[i].stolen,
+			        (unsigned long long)workers[i].bytes);
+		}
+	}
+
+	close(pool.epfd);
+	close(pool.mirror_epfd);
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Shared memory grid reader.
+ *
+ * Maps a grid exported by mt_shm_export() and prints a consistent frame.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mt-common.h"
+#include "mt-shm.h"
+
+static void dump(struct mt_shm_frame *frame, struct mt_char *cells)
+{
+	unsigned int r, c;
+
+	printf("Generation: %llu\n", (unsigned long long)frame->generation);
+
+	for (r = 0; r < frame->rows; r++) {
+		putchar('|');
+
+		for (c = 0; c < frame->cols; c++) {
+			uint8_t ch = cells[r * frame->cols + c].c;
+
+			putchar(ch ? ch : ' ');
+		}
+
+		printf("|\n");
+	}
+
+	printf("size %ux%u cursor %ux%u%s\n", frame->rows, frame->cols,
+	       frame->cur_row, frame->cur_col,
+	       frame->flags & MT_SHM_CURSOR_HIDDEN ? " hidden" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	struct mt_shm_reader reader;
+	struct mt_shm_frame frame;
+	struct mt_char *cells = NULL;
+	size_t cells_cnt = 0;
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s name\n", argv[0]);
+		return 1;
+	}
+
+	if (mt_shm_reader_open(&reader, argv[1])) {
+		fprintf(stderr, "Can't open '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	while ((ret = mt_shm_read(&reader, &frame, cells, cells_cnt)) == 1) {
+		cells_cnt = (size_t)frame.cols * frame.rows;
+
+		cells = realloc(cells, cells_cnt * sizeof(*cells));
+		if (!cells)
+			MT_ERROR_MALLOC;
+	}
+
+	if (ret) {
+		fprintf(stderr, "Can't read '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	dump(&frame, cells);
+
+	free(cells);
+	mt_shm_reader_close(&reader);
+
+	return 0;
+}
@@ -4,12 +4,24 @@
  */
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
 #include "mt-common.h"
 #include "mt-screen.h"
 #include "mt-sbuf.h"
 #include "mt-parser.h"
+#include "mt-stats.h"
+#include "mt-search.h"
+#include "mt-export.h"
+#include "mt-mirror.h"
+#include "mt-snap.h"
+#include "mt-shm.h"
 
 static int verbose;
+/* Directory with the test binaries */
+static char *bin_dir;
 
 static void make_buf(char *buf)
 {
@@ -63,56 +75,497 @@ next:
 	buf[out-1] = 0;
 }
 
-static int cursor_fail;
+struct cursor_track {
+	mt_coord col, row;
+	int saved;
+	int first;
+	int fail;
+};
 
-static void track_cursor(mt_coord col, mt_coord row, uint8_t set)
+static void track_cursor(void *priv, mt_coord col, mt_coord row, uint8_t set)
 {
-	static mt_coord scol, srow;
-	static int saved;
-	static int first;
+	struct cursor_track *track = priv;
 
-	if (!first) {
-		first = 1;
+	if (!track->first) {
+		track->first = 1;
 		return;
 	}
 
 	if (verbose)
 		fprintf(stderr, "Cursor set %u %u %i\n", col, row, set);
 
-	if (set && saved) {
+	if (set && track->saved) {
 		fprintf(stderr, "Cursor set twice!\n");
-		cursor_fail++;
+		track->fail++;
 		return;
 	}
 
-	if (!set && !saved) {
+	if (!set && !track->saved) {
 		fprintf(stderr, "Cursor unset twice!\n");
-		cursor_fail++;
+		track->fail++;
 		return;
 	}
 
 	if (set) {
-		scol = col;
-		srow = row;
-		saved = 1;
+		track->col = col;
+		track->row = row;
+		track->saved = 1;
 	} else {
-		if (scol != col || srow != row)
-			cursor_fail++;
-		saved = 0;
+		if (track->col != col || track->row != row)
+			track->fail++;
+		track->saved = 0;
 	}
 }
 
 static unsigned int bell_counter;
 
-static void bell(void)
+static void bell(void *priv)
 {
-	bell_counter++;
+	unsigned int *counter = priv;
+
+	(*counter)++;
 }
 
+static struct cursor_track cursor_track;
+
 static struct mt_screen screen = {
 	.cursor = track_cursor,
+	.priv = &cursor_track,
 };
 
+static void cmd_hist(struct mt_sbuf *sbuf)
+{
+	struct mt_hist *hist = &sbuf->hist;
+	uint64_t line;
+	size_t i, len;
+
+	for (line = hist->first; line < hist->first + mt_hist_lines(hist); line++) {
+		const struct mt_char *cells = mt_hist_line(hist, line, &len);
+
+		printf("Hist %llu: |", (unsigned long long)line);
+
+		for (i = 0; cells && i < len; i++)
+			putchar(isprint(mt_char_c(&cells[i])) ? mt_char_c(&cells[i]) : ' ');
+
+		printf("|\n");
+	}
+}
+
+static void cmd_bg(struct mt_sbuf *sbuf)
+{
+	mt_coord col, row;
+
+	for (row = 0; row < sbuf->rows; row++) {
+		struct mt_row *srow = &sbuf->srow[mt_sbuf_row_idx(sbuf, row)];
+
+		putchar('|');
+
+		for (col = 0; col < sbuf->cols; col++) {
+			const struct mt_char *c = &srow->blank_char;
+
+			if (!srow->blank)
+				c = &mt_sbuf_row(sbuf, row)[col];
+
+			putchar('0' + mt_char_bg_col(c));
+		}
+
+		printf("|\n");
+	}
+}
+
+static void cmd_search(struct mt_sbuf *sbuf, const char *pattern,
+                       enum mt_search_flags flags)
+{
+	struct mt_search *search;
+	struct mt_match match;
+	size_t i;
+
+	search = mt_search_start(sbuf, pattern, flags);
+	if (!search) {
+		printf("Search '%s' failed\n", pattern);
+		return;
+	}
+
+	while (!mt_search_done(search))
+		usleep(1000);
+
+	printf("Search '%s': %zu matches, %zu blocks skipped\n", pattern,
+	       mt_search_match_cnt(search), mt_search_blks_skipped(search));
+
+	for (i = 0; mt_search_matches(search, &match, i, 1); i++) {
+		printf("Match line %llu col %u len %u\n",
+		       (unsigned long long)match.line, match.col, match.len);
+	}
+
+	mt_search_free(search);
+}
+
+static void cmd_export(struct mt_sbuf *sbuf, char type, const struct mt_sel *sel,
+                       enum mt_export_flags flags)
+{
+	struct mt_sel s = *sel;
+	size_t i, len;
+	char *buf;
+
+	s.type = type == 'r' ? MT_SEL_RECT : MT_SEL_LINEAR;
+
+	len = mt_sbuf_export(sbuf, &s, flags, NULL, 0);
+
+	buf = malloc(len + 1);
+	if (!buf)
+		MT_ERROR_MALLOC;
+
+	mt_sbuf_export(sbuf, &s, flags, buf, len + 1);
+
+	printf("Export %zu bytes:\n", len);
+
+	for (i = 0; i < len; i++) {
+		switch (buf[i]) {
+		case '\e':
+			printf("\\e");
+		break;
+		case '\n':
+			printf("$\n");
+		break;
+		default:
+			putchar(buf[i]);
+		}
+	}
+
+	if (len && buf[len - 1] != '\n')
+		printf("\n");
+
+	free(buf);
+}
+
+/*
+ * The screen is mirrored to a mterm-mirror client and the frames it applied
+ * are printed once the mirror is closed.
+ */
+#define MIRROR_SOCK "mterm-test.sock"
+#define MIRROR_WAIT_MS 2000
+
+static struct {
+	struct mt_mirror mirror;
+	FILE *client;
+	int running;
+} mirror;
+
+/*
+ * Runs the mirror until the client got everything.
+ */
+static int mirror_sync(void)
+{
+	struct mt_mirror_client *c;
+	int i;
+
+	for (i = 0; i < MIRROR_WAIT_MS; i++) {
+		mt_mirror_run(&mirror.mirror);
+
+		c = mirror.mirror.clients;
+
+		if (c && !mt_delta_pending(&c->delta) && !mt_wqueue_pending(&c->out))
+			return 0;
+
+		usleep(1000);
+	}
+
+	printf("Mirror sync timed out\n");
+	return 1;
+}
+
+static void cmd_mirror(struct mt_sbuf *sbuf)
+{
+	char cmd[1024];
+
+	if (mt_mirror_init(&mirror.mirror, sbuf, MIRROR_SOCK)) {
+		printf("Mirror init failed: %s\n", strerror(errno));
+		return;
+	}
+
+	snprintf(cmd, sizeof(cmd), "%s/mterm-mirror -v -t %i %s",
+	         bin_dir, MIRROR_WAIT_MS, MIRROR_SOCK);
+
+	mirror.client = popen(cmd, "r");
+	if (!mirror.client) {
+		printf("Can't run '%s': %s\n", cmd, strerror(errno));
+		mt_mirror_exit(&mirror.mirror);
+		return;
+	}
+
+	mirror.running = 1;
+	mirror_sync();
+}
+
+static void cmd_mirror_end(void)
+{
+	char buf[1024];
+
+	if (!mirror.running)
+		return;
+
+	mirror_sync();
+	mt_mirror_exit(&mirror.mirror);
+
+	printf("Mirror:\n");
+
+	while (fgets(buf, sizeof(buf), mirror.client))
+		fputs(buf, stdout);
+
+	pclose(mirror.client);
+	mirror.running = 0;
+}
+
+static void cmd_spill(struct mt_sbuf *sbuf)
+{
+	const char *dir = getenv("TMPDIR");
+
+	if (mt_hist_set_spill(&sbuf->hist, dir ? dir : "/tmp", 0))
+		printf("Spill failed: %s\n", strerror(errno));
+}
+
+static void cmd_blocks(struct mt_sbuf *sbuf)
+{
+	struct mt_hist *hist = &sbuf->hist;
+	size_t i;
+
+	for (i = 0; i < hist->blk_cnt; i++) {
+		struct mt_hist_blk *blk = hist->blks[i];
+
+		printf("Block %zu: first %llu lines %u%s%s\n", i,
+		       (unsigned long long)blk->first, blk->line_cnt,
+		       blk->sealed ? " sealed" : "", blk->map ? " mapped" : "");
+	}
+}
+
+static int shm_open_reader(struct mt_sbuf *sbuf, struct mt_shm_reader *reader)
+{
+	char path[64];
+
+	if (!sbuf->shm && mt_shm_export(sbuf, "mterm-test")) {
+		printf("Shm export failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%i", mt_shm_fd(sbuf));
+
+	if (mt_shm_reader_open(reader, path)) {
+		printf("Shm open failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static void shm_compare(struct mt_sbuf *sbuf, const struct mt_shm_frame *frame,
+                        const struct mt_char *cells)
+{
+	mt_coord col, row;
+
+	if (frame->cols != (uint32_t)sbuf->cols || frame->rows != (uint32_t)sbuf->rows ||
+	    frame->cur_col != (uint32_t)sbuf->cur_col || frame->cur_row != (uint32_t)sbuf->cur_row) {
+		printf("Shm frame %ux%u cursor %ux%u differs\n", frame->cols, frame->rows,
+		       frame->cur_row, frame->cur_col);
+		return;
+	}
+
+	for (row = 0; row < sbuf->rows; row++) {
+		struct mt_row *srow = &sbuf->srow[mt_sbuf_row_idx(sbuf, row)];
+		const struct mt_char *line = cells + (size_t)row * sbuf->cols;
+
+		for (col = 0; col < sbuf->cols; col++) {
+			const struct mt_char *c = &srow->blank_char;
+
+			if (!srow->blank)
+				c = &mt_sbuf_row(sbuf, row)[col];
+
+			if (memcmp(c, &line[col], sizeof(*c))) {
+				printf("Shm row %u col %u differs\n", row, col);
+				return;
+			}
+		}
+	}
+
+	printf("Shm frame %ux%u cursor %ux%u matches\n", frame->cols, frame->rows,
+	       frame->cur_row, frame->cur_col);
+}
+
+static void cmd_shm(struct mt_sbuf *sbuf, int stuck)
+{
+	struct mt_shm_reader reader;
+	struct mt_shm_frame frame;
+	struct mt_char *cells = NULL;
+	size_t cells_cnt = 0;
+	int ret;
+
+	if (shm_open_reader(sbuf, &reader))
+		return;
+
+	if (stuck)
+		mt_shm_begin(sbuf);
+
+	while ((ret = mt_shm_read(&reader, &frame, cells, cells_cnt)) == 1) {
+		cells_cnt = (size_t)frame.cols * frame.rows;
+
+		cells = realloc(cells, cells_cnt * sizeof(*cells));
+		if (!cells)
+			MT_ERROR_MALLOC;
+	}
+
+	if (stuck)
+		mt_shm_end(sbuf);
+
+	if (ret)
+		printf("Shm read failed: %s\n", strerror(errno));
+	else
+		shm_compare(sbuf, &frame, cells);
+
+	free(cells);
+	mt_shm_reader_close(&reader);
+}
+
+#define SNAP_PATH "mterm-test.snap"
+
+static void cmd_snap_save(struct mt_parser *parser)
+{
+	if (mt_snap_save(parser, SNAP_PATH))
+		printf("Snapshot save failed: %s\n", strerror(errno));
+}
+
+static void cmd_snap_load(struct mt_parser *parser)
+{
+	if (mt_snap_load(parser, SNAP_PATH))
+		printf("Snapshot load failed: %s\n", strerror(errno));
+
+	unlink(SNAP_PATH);
+}
+
+/*
+ * Lines starting with @ are commands instead of terminal input:
+ *
+ * @resize cols rows - resizes the screen
+ * @hist             - prints the history, one logical line per row
+ * @bg               - prints background colors of the screen
+ * @search pattern   - prints search matches, @isearch ignores case and
+ *                     @rsearch takes a regular expression
+ * @export l|r s_line s_col e_line e_col [sgr]
+ *                   - prints a linear or rectangular selection, ESC is
+ *                     printed as \e and line ends as $
+ * @mirror           - starts mirroring the screen to mterm-mirror
+ * @sync             - waits until the mirror client got all changes
+ * @mirror-end       - disconnects the client and prints what it got
+ * @spill            - spills all sealed history blocks into a file
+ * @blocks           - prints history blocks
+ * @shm              - exports the grid into a memfd, reads it back and
+ *                     compares it with the screen
+ * @shm-stuck        - reads the exported grid in the middle of an update
+ * @snap-save        - saves a snapshot into a temporary file
+ * @snap-load        - restores the snapshot and removes the file
+ */
+static void do_cmd(struct mt_parser *parser, char *cmd)
+{
+	struct mt_sbuf *sbuf = parser->sbuf;
+	unsigned int cols, rows;
+	unsigned long long s_line, e_line;
+	struct mt_sel sel;
+	char type, sgr[4];
+	int ret;
+
+	cmd[strcspn(cmd, "\n")] = 0;
+
+	if (verbose)
+		fprintf(stderr, "Command '%s'\n", cmd);
+
+	if (sscanf(cmd, "@resize %u %u", &cols, &rows) == 2) {
+		if (mt_sbuf_resize(sbuf, cols, rows))
+			printf("Resize %ux%u failed: %s\n", cols, rows, strerror(errno));
+		return;
+	}
+
+	if (!strcmp(cmd, "@hist")) {
+		cmd_hist(sbuf);
+		return;
+	}
+
+	if (!strcmp(cmd, "@bg")) {
+		cmd_bg(sbuf);
+		return;
+	}
+
+	ret = sscanf(cmd, "@export %c %llu %zu %llu %zu %3s", &type, &s_line,
+	             &sel.s_col, &e_line, &sel.e_col, sgr);
+	if (ret >= 5) {
+		sel.s_line = s_line;
+		sel.e_line = e_line;
+		cmd_export(sbuf, type, &sel, ret == 6 ? MT_EXPORT_SGR : 0);
+		return;
+	}
+
+	if (!strcmp(cmd, "@mirror")) {
+		cmd_mirror(sbuf);
+		return;
+	}
+
+	if (!strcmp(cmd, "@sync")) {
+		if (mirror.running)
+			mirror_sync();
+		return;
+	}
+
+	if (!strcmp(cmd, "@mirror-end")) {
+		cmd_mirror_end();
+		return;
+	}
+
+	if (!strcmp(cmd, "@spill")) {
+		cmd_spill(sbuf);
+		return;
+	}
+
+	if (!strcmp(cmd, "@blocks")) {
+		cmd_blocks(sbuf);
+		return;
+	}
+
+	if (!strcmp(cmd, "@shm")) {
+		cmd_shm(sbuf, 0);
+		return;
+	}
+
+	if (!strcmp(cmd, "@shm-stuck")) {
+		cmd_shm(sbuf, 1);
+		return;
+	}
+
+	if (!strcmp(cmd, "@snap-save")) {
+		cmd_snap_save(parser);
+		return;
+	}
+
+	if (!strcmp(cmd, "@snap-load")) {
+		cmd_snap_load(parser);
+		return;
+	}
+
+	if (!strncmp(cmd, "@search ", 8)) {
+		cmd_search(sbuf, cmd + 8, 0);
+		return;
+	}
+
+	if (!strncmp(cmd, "@isearch ", 9)) {
+		cmd_search(sbuf, cmd + 9, MT_SEARCH_ICASE);
+		return;
+	}
+
+	if (!strncmp(cmd, "@rsearch ", 9)) {
+		cmd_search(sbuf, cmd + 9, MT_SEARCH_REGEX);
+		return;
+	}
+
+	fprintf(stderr, "Invalid command '%s'\n", cmd);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 	struct mt_sbuf *sbuf;
@@ -134,6 +587,11 @@ int main(int argc, char *argv[])
 		verbose = 1;
 	}
 
+	bin_dir = dirname(strdup(argv[0]));
+
+	/* Disconnected mirror client is handled by write() errors */
+	signal(SIGPIPE, SIG_IGN);
+
 	FILE *f = fopen(fname, "r");
 
 	if (!f) {
@@ -144,7 +602,7 @@ int main(int argc, char *argv[])
 
 	fscanf(f, "%u\n%u%*c", &cols, &rows);
 
-	sbuf->screen = &screen;
+	mt_sbuf_screen_add(sbuf, &screen);
 
 	if (mt_sbuf_resize(sbuf, cols, rows))
 		MT_ERROR_MALLOC;
@@ -154,23 +612,35 @@ int main(int argc, char *argv[])
 	mt_parser_init(&parser, sbuf, 0, 0);
 
 	parser.bell = bell;
+	parser.priv = &bell_counter;
 
 	while (fgets(buf, sizeof(buf), f)) {
+		if (buf[0] == '@') {
+			do_cmd(&parser, buf);
+			continue;
+		}
+
 		make_buf(buf);
 		mt_parse(&parser, buf, strlen(buf));
 	}
 
 	fclose(f);
 
+	cmd_mirror_end();
+
+	if (verbose) {
+		mt_diag_dump(&parser.diag, stderr, 1);
+		mt_stats_dump(&mt_stats, stderr);
+	}
+
 	mt_sbuf_dump_screen(sbuf);
 
 	if (bell_counter)
 		printf("Bells: %u\n", bell_counter);
 
-	free(sbuf->sbuf);
-	free(sbuf);
+	mt_sbuf_free(sbuf);
 
-	if (cursor_fail) {
+	if (cursor_track.fail) {
 		fprintf(stderr, "Cursor not unset!\n");
 		return 1;
 	}
@@ -2,18 +2,36 @@
 /*
  * Copyright (C) 2019-2022 Cyril Hrubis <metan@ucw.cz>
  */
+#define _GNU_SOURCE
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
 #include <pty.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <gfxprim.h>
 
 #include "mt-common.h"
 #include "mt-sbuf.h"
 #include "mt-parser.h"
 #include "mt-screen.h"
+#include "mt-stats.h"
+#include "mt-trace.h"
+#include "mt-latency.h"
+#include "mt-ring.h"
+#include "mt-uring.h"
+#include "mt-wqueue.h"
+#include "mt-mirror.h"
+#include "mt-shm.h"
+#include "mt-pool.h"
 
 static struct {
 	char r;
@@ -76,6 +94,227 @@ static gp_backend *win;
 static struct mt_damage damage;
 static struct mt_sbuf *sbuf;
 
+/* PTY output is read into the ring and parsed in place */
+#define INPUT_RING_SIZE (256 * 1024)
+static struct mt_ring input;
+
+/*
+ * PTY I/O goes over io_uring unless MTERM_NO_URING is set or io_uring is not
+ * available, then we fall back to read() and write().
+ */
+static struct mt_uring uring;
+static int use_uring;
+
+/*
+ * Without io_uring key input and parser responses are queued and written
+ * once per main loop iteration by pty_flush().
+ */
+static struct mt_wqueue output;
+
+static void pty_write(const char *buf, size_t len)
+{
+	int ret;
+
+	if (use_uring)
+		ret = mt_uring_write(&uring, buf, len);
+	else
+		ret = mt_wqueue_add(&output, buf, len);
+
+	if (ret)
+		fprintf(stderr, "WRITE queue allocation failed\n");
+}
+
+static void pty_flush(int fd)
+{
+	if (use_uring)
+		return;
+
+	if (mt_wqueue_flush(&output, fd) < 0) {
+		fprintf(stderr, "WRITE %s\n", strerror(errno));
+		mt_wqueue_free(&output);
+	}
+}
+
+/*
+ * Kernels that have io_uring but can't read the PTY over it fail the first
+ * read, data queued for writing are moved into the write() queue.
+ */
+static void uring_fallback(void)
+{
+	struct mt_wqueue *queues[] = {&uring.out_flight, &uring.out, NULL};
+	unsigned int i;
+
+	fprintf(stderr, "io_uring can't read PTY, falling back to read()\n");
+
+	for (i = 0; queues[i]; i++) {
+		size_t len = mt_wqueue_pending(queues[i]);
+
+		if (len && mt_wqueue_add(&output, queues[i]->buf + queues[i]->off, len))
+			fprintf(stderr, "WRITE queue allocation failed\n");
+	}
+
+	mt_uring_exit(&uring);
+	use_uring = 0;
+}
+
+static size_t pty_pending(void)
+{
+	if (use_uring)
+		return mt_uring_pending(&uring);
+
+	return mt_wqueue_pending(&output);
+}
+
+/*
+ * Pasted text is streamed into the PTY in PASTE_CHUNK sized pieces, the next
+ * chunk is queued only when the data queued so far were mostly written, so a
+ * large paste does not pile up in the write queue and key input is not stuck
+ * behind it. The paste is cancelled by pressing Escape, any other key cancels
+ * it as well and is sent after the rest of the paste is dropped, so that key
+ * input never ends up inside of the bracketed paste.
+ *
+ * In bracketed paste mode the text is wrapped in the start and end markers
+ * and ESC characters are dropped so that the text cannot end the paste early.
+ *
+ * Progress of a paste is shown in the window title.
+ */
+#define PASTE_CHUNK 4096
+#define CAPTION "term"
+
+static struct {
+	char *data;
+	size_t len;
+	size_t off;
+	uint8_t bracketed:1;
+	/* Progress shown in the title in percents */
+	unsigned int pct;
+} paste;
+
+static void paste_caption(void)
+{
+	char caption[64];
+
+	if (!paste.data) {
+		gp_backend_set_caption(win, CAPTION);
+		return;
+	}
+
+	snprintf(caption, sizeof(caption), CAPTION " - pasting %u%%", paste.pct);
+	gp_backend_set_caption(win, caption);
+}
+
+static void paste_end(void)
+{
+	if (paste.bracketed)
+		pty_write("\e[201~", 6);
+
+	free(paste.data);
+	paste.data = NULL;
+
+	paste_caption();
+}
+
+static void paste_cancel(void)
+{
+	if (!paste.data)
+		return;
+
+	paste_end();
+}
+
+static void paste_start(const char *data, size_t len)
+{
+	size_t i, j = 0;
+
+	paste_cancel();
+
+	if (!len)
+		return;
+
+	paste.data = malloc(len);
+	if (!paste.data) {
+		fprintf(stderr, "Paste allocation failed\n");
+		return;
+	}
+
+	paste.bracketed = parser.bracketed_paste;
+
+	for (i = 0; i < len; i++) {
+		if (paste.bracketed && data[i] == '\e')
+			continue;
+
+		/* Newlines are sent as Enter, CRLF as a single one */
+		if (data[i] == '\r' && i + 1 < len && data[i+1] == '\n')
+			continue;
+
+		paste.data[j++] = data[i] == '\n' ? '\r' : data[i];
+	}
+
+	paste.len = j;
+	paste.off = 0;
+	paste.pct = 0;
+
+	if (paste.bracketed)
+		pty_write("\e[200~", 6);
+
+	paste_caption();
+}
+
+static void paste_step(void)
+{
+	size_t len;
+	unsigned int pct;
+
+	if (!paste.data || pty_pending() >= PASTE_CHUNK)
+		return;
+
+	len = MT_MIN(paste.len - paste.off, (size_t)PASTE_CHUNK);
+
+	pty_write(paste.data + paste.off, len);
+	paste.off += len;
+
+	if (paste.off == paste.len) {
+		paste_end();
+		return;
+	}
+
+	pct = 100 * paste.off / paste.len;
+
+	if (pct / 10 == paste.pct / 10)
+		return;
+
+	paste.pct = pct;
+	paste_caption();
+}
+
+
+/*
+ * If MTERM_LATENCY is set keypresses written to the PTY are timestamped and
+ * matched against the first backend update after the application responded.
+ */
+static struct {
+	uint8_t enabled:1;
+	/* PTY output arrived since the last keypress */
+	uint8_t response:1;
+	struct mt_latency hist;
+} latency;
+
+static void latency_key(void)
+{
+	if (!latency.enabled)
+		return;
+
+	mt_latency_key(&latency.hist, mt_latency_now());
+	latency.response = 0;
+}
+
+static void latency_shown(void)
+{
+	if (!latency.response || !latency.hist.pending_cnt)
+		return;
+
+	mt_latency_frame(&latency.hist, mt_latency_now());
+}
 
 static const gp_font_face *font_normal;
 static const gp_font_face *font_bold;
@@ -93,6 +332,8 @@ static void draw_char(struct mt_char *c, gp_coord col, gp_coord row)
 	gp_pixel bg = bg_col(c);
 	gp_pixel fg = fg_col(c);
 
+	mt_stat_inc(MT_STAT_CELLS_DRAWN);
+
 	if (c->reverse)
 		MT_SWAP(bg, fg);
 
@@ -101,15 +342,153 @@ static void draw_char(struct mt_char *c, gp_coord col, gp_coord row)
 		 fg, 0, "%c", mt_char_c(c));
 }
 
+/*
+ * Blank rows are filled with a single rectangle.
+ */
+static void draw_blank(const struct mt_char *c, mt_coord s_col, mt_coord e_col, mt_coord row)
+{
+	gp_coord sy = row * cell_h;
+
+	mt_stat_add(MT_STAT_CELLS_DRAWN, e_col - s_col);
+
+	gp_fill_rect_xyxy(win->pixmap, s_col * cell_w, sy, e_col * cell_w - 1, sy + cell_h - 1, bg_col(c));
+}
+
+/*
+ * Backend updates are accumulated during a frame and pushed once by
+ * update_flush().
+ *
+ * Touching rectangles are merged, when the queue is full the new rectangle is
+ * merged with the one that grows the least. If the rectangles cover at least
+ * UPDATE_FLIP_PCT of the window, the whole window is flipped instead.
+ */
+#define UPDATE_RECTS 8
+#define UPDATE_FLIP_PCT 50
+
+struct rect {
+	gp_coord x0, y0, x1, y1;
+};
+
+static struct {
+	unsigned int cnt;
+	struct rect rects[UPDATE_RECTS];
+} updates;
+
+static uint64_t rect_area(const struct rect *r)
+{
+	return (uint64_t)(r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1);
+}
+
+static struct rect rect_union(const struct rect *a, const struct rect *b)
+{
+	struct rect r = {
+		.x0 = MT_MIN(a->x0, b->x0),
+		.y0 = MT_MIN(a->y0, b->y0),
+		.x1 = MT_MAX(a->x1, b->x1),
+		.y1 = MT_MAX(a->y1, b->y1),
+	};
+
+	return r;
+}
+
+static int rect_touch(const struct rect *a, const struct rect *b)
+{
+	return a->x0 <= b->x1 + 1 && b->x0 <= a->x1 + 1 &&
+	       a->y0 <= b->y1 + 1 && b->y0 <= a->y1 + 1;
+}
+
+static void update_rect(gp_coord sx, gp_coord sy, gp_coord ex, gp_coord ey)
+{
+	struct rect u, r = {sx, sy, ex, ey};
+	unsigned int i, best;
+	uint64_t grow, best_grow;
+
+	mt_stat_inc(MT_STAT_UPDATES_QUEUED);
+
+	for (;;) {
+		for (i = 0; i < updates.cnt; i++) {
+			if (rect_touch(&r, &updates.rects[i]))
+				break;
+		}
+
+		if (i < updates.cnt) {
+			r = rect_union(&r, &updates.rects[i]);
+			updates.rects[i] = updates.rects[--updates.cnt];
+			continue;
+		}
+
+		if (updates.cnt < UPDATE_RECTS) {
+			updates.rects[updates.cnt++] = r;
+			return;
+		}
+
+		best = 0;
+		best_grow = UINT64_MAX;
+
+		for (i = 0; i < updates.cnt; i++) {
+			u = rect_union(&r, &updates.rects[i]);
+			grow = rect_area(&u) - rect_area(&updates.rects[i]);
+
+			if (grow < best_grow) {
+				best_grow = grow;
+				best = i;
+			}
+		}
+
+		r = rect_union(&r, &updates.rects[best]);
+		updates.rects[best] = updates.rects[--updates.cnt];
+	}
+}
+
 static void update_region(mt_coord s_col, mt_coord e_col,
                           mt_coord s_row, mt_coord e_row)
 {
-	gp_coord sx = s_col * cell_w;
-	gp_coord sy = s_row * cell_h;
-	gp_coord ex = e_col * cell_w - 1;
-	gp_coord ey = e_row * cell_h - 1;
+	update_rect(s_col * cell_w, s_row * cell_h, e_col * cell_w - 1, e_row * cell_h - 1);
+}
+
+static void backend_flip(void)
+{
+	uint64_t trace = mt_trace_begin();
+
+	mt_stat_inc(MT_STAT_FLIPS);
+
+	gp_backend_flip(win);
+	latency_shown();
+
+	updates.cnt = 0;
+
+	mt_trace_end(MT_TRACE_FLIP, trace, 0);
+}
+
+static void update_flush(void)
+{
+	uint64_t trace, area = 0;
+	unsigned int i;
+
+	if (!updates.cnt)
+		return;
+
+	for (i = 0; i < updates.cnt; i++)
+		area += rect_area(&updates.rects[i]);
+
+	if (area * 100 >= (uint64_t)gp_pixmap_w(win->pixmap) * gp_pixmap_h(win->pixmap) * UPDATE_FLIP_PCT) {
+		backend_flip();
+		return;
+	}
+
+	for (i = 0; i < updates.cnt; i++) {
+		struct rect *r = &updates.rects[i];
+
+		trace = mt_trace_begin();
+		mt_stat_inc(MT_STAT_UPDATES);
 
-	gp_backend_update_rect_xyxy(win, sx, sy, ex, ey);
+		gp_backend_update_rect_xyxy(win, r->x0, r->y0, r->x1, r->y1);
+
+		mt_trace_end(MT_TRACE_UPDATE, trace, rect_area(r));
+	}
+
+	updates.cnt = 0;
+	latency_shown();
 }
 
 static void redraw_region(mt_coord s_row, mt_coord e_row,
@@ -118,6 +497,11 @@ static void redraw_region(mt_coord s_row, mt_coord e_row,
 	mt_coord col, row;
 
 	for (row = s_row; row < e_row; row++) {
+		if (mt_sbuf_row_blank(parser.sbuf, row)) {
+			draw_blank(mt_sbuf_row_blank_char(parser.sbuf, row), s_col, e_col, row);
+			continue;
+		}
+
 		struct mt_char *c = mt_sbuf_row(parser.sbuf, row);
 		for (col = s_col; col < e_col; col++)
 			draw_char(&c[col], col, row);
@@ -126,61 +510,87 @@ static void redraw_region(mt_coord s_row, mt_coord e_row,
 
 static void do_damage(void)
 {
+	uint32_t cells = (damage.e_col - damage.s_col) * (damage.e_row - damage.s_row);
+	uint64_t trace = mt_trace_begin();
+
+	mt_stat_add(MT_STAT_DAMAGE_CELLS, cells);
+
 	redraw_region(damage.s_row, damage.e_row, damage.s_col, damage.e_col);
+
+	mt_trace_end(MT_TRACE_DAMAGE, trace, cells);
+
 	update_region(damage.s_col, damage.e_col, damage.s_row, damage.e_row);
 }
 
-static void do_scroll_down(int lines)
+/*
+ * Moves pixel rows [s_y, e_y) by dy pixels, the areas may overlap.
+ *
+ * Rows in a pixmap without rotation are contiguous, so the whole band is moved
+ * with a single memmove(). Otherwise we blit text rows in an order that does
+ * not overwrite rows that were not moved yet.
+ */
+static void move_rows(gp_pixmap *p, gp_coord s_y, gp_coord e_y, gp_coord dy)
 {
-	gp_coord mid_y = lines * cell_h;
-	gp_coord end_y = gp_pixmap_h(win->pixmap) - 1;
-	gp_coord end_x = gp_pixmap_w(win->pixmap) - 1;
+	gp_coord end_x = gp_pixmap_w(p) - 1;
+	gp_coord y;
 
-	if (mid_y >= end_y)
+	if (!p->axes_swap && !p->x_swap && !p->y_swap) {
+		memmove(p->pixels + (s_y + dy) * p->bytes_per_row,
+		        p->pixels + s_y * p->bytes_per_row,
+		        (size_t)(e_y - s_y) * p->bytes_per_row);
 		return;
+	}
 
-	gp_pixel bg = bg_col(mt_sbuf_cur_char(sbuf));
-
-	gp_blit_xyxy(win->pixmap, 0, mid_y, end_x, end_y, win->pixmap, 0, 0);
-	gp_fill_rect_xyxy(win->pixmap, 0, end_y - mid_y, end_x, end_y, bg);
-	gp_backend_flip(win);
+	if (dy < 0) {
+		for (y = s_y; y < e_y; y += cell_h)
+			gp_blit_xyxy(p, 0, y, end_x, y + cell_h - 1, p, 0, y + dy);
+	} else {
+		for (y = e_y - cell_h; y >= s_y; y -= cell_h)
+			gp_blit_xyxy(p, 0, y, end_x, y + cell_h - 1, p, 0, y + dy);
+	}
 }
 
-static void do_scroll_up(int lines)
+/*
+ * Scrolls text rows [s_row, e_row) by lines, positive lines move the content
+ * up. Only the region is pushed to the backend.
+ */
+static void scroll_region(mt_coord s_row, mt_coord e_row, int lines)
 {
-	gp_coord mid_y = -lines * cell_h;
-	gp_coord end_y = gp_pixmap_h(win->pixmap) - 1;
-	gp_coord end_x = gp_pixmap_w(win->pixmap) - 1;
-
-	if (mid_y >= end_y)
-		return;
-
+	gp_pixmap *p = win->pixmap;
+	gp_coord end_x = gp_pixmap_w(p) - 1;
+	gp_coord sy = s_row * cell_h;
+	gp_coord ey = e_row * cell_h;
+	gp_coord dy = lines * cell_h;
 	gp_pixel bg = bg_col(mt_sbuf_cur_char(sbuf));
-	int col;
 
-	//TODO: Reverse blit?
-	for (col = end_y/cell_h + lines - 1; col >= 0; col--) {
-		gp_coord y = col * cell_h;
-		gp_blit_xyxy(win->pixmap, 0, y, end_x, y + cell_h,
-		             win->pixmap, 0, mid_y + y);
+	if (abs(lines) >= e_row - s_row) {
+		gp_fill_rect_xyxy(p, 0, sy, end_x, ey - 1, bg);
+	} else if (lines > 0) {
+		move_rows(p, sy + dy, ey, -dy);
+		gp_fill_rect_xyxy(p, 0, ey - dy, end_x, ey - 1, bg);
+	} else {
+		move_rows(p, sy, ey + dy, -dy);
+		gp_fill_rect_xyxy(p, 0, sy, end_x, sy - dy - 1, bg);
 	}
 
-	gp_fill_rect_xyxy(win->pixmap, 0, 0, end_x, mid_y, bg);
-	gp_backend_flip(win);
+	update_rect(0, sy, end_x, ey - 1);
 }
 
 static void do_scroll(int lines)
 {
-	if (lines > 0)
-		do_scroll_down(lines);
-	else
-		do_scroll_up(lines);
+	uint64_t trace = mt_trace_begin();
+
+	scroll_region(0, rows, lines);
+
+	mt_trace_end(MT_TRACE_SCROLL, trace, abs(lines));
 }
 
-static void cursor(mt_coord col, mt_coord row, uint8_t set)
+static void cursor(void *priv, mt_coord col, mt_coord row, uint8_t set)
 {
 	struct mt_char *c;
 
+	(void)priv;
+
 	if (col > 0 && row > 0) {
 		c = mt_sbuf_char(parser.sbuf, col, row);
 		draw_char(c, col, row);
@@ -188,7 +598,7 @@ static void cursor(mt_coord col, mt_coord row, uint8_t set)
 	}
 }
 
-static void erase(mt_coord s_col, mt_coord s_row, mt_coord e_col, mt_coord e_row)
+static void erase(void *priv, mt_coord s_col, mt_coord s_row, mt_coord e_col, mt_coord e_row)
 {
 	gp_coord sx1 = s_col * cell_w;
 	gp_coord sy1 = s_row * cell_h;
@@ -196,8 +606,10 @@ static void erase(mt_coord s_col, mt_coord s_row, mt_coord e_col, mt_coord e_row
 	gp_coord sy2 = (e_row+1) * cell_h;
 	gp_pixel bg = bg_col(mt_sbuf_cur_char(sbuf));
 
+	(void)priv;
+
 	gp_fill_rect_xyxy(win->pixmap, sx1, sy1, sx2-1, sy2-1, bg);
-	gp_backend_update_rect(win, sx1, sy1, sx2-1, sy2-1);
+	update_rect(sx1, sy1, sx2-1, sy2-1);
 }
 
 static struct mt_screen screen = {
@@ -219,75 +631,264 @@ void init_mterm(void)
 	if (mt_sbuf_resize(sbuf, cols, rows))
 		MT_ERROR_MALLOC;
 
-	sbuf->screen = &screen;
+	mt_sbuf_screen_add(sbuf, &screen);
+	mt_sbuf_set_fast_forward(sbuf, 1);
+
+	mt_damage_reset(&damage);
+
+	if (mt_ring_init(&input, INPUT_RING_SIZE))
+		MT_ERROR_MALLOC;
 
 	mt_parser_init(&parser, sbuf, 7, 0);
 }
 
-static void vt_read(int fd)
+static uint64_t time_ms(void)
 {
-	char buf[1024];
-	int ret, i;
+	struct timespec ts;
 
-	mt_damage_reset(&damage);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	for (i = 0; i < 100; i++) {
-		ret = read(fd, buf, sizeof(buf));
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		if (ret < 0 && errno == EAGAIN)
-			break;
+/*
+ * Echo fast path.
+ *
+ * Right after a keypress the application usually responds with a handful of
+ * bytes, these are rendered as soon as they arrive instead of being batched
+ * with further reads. Once the response grows over ECHO_MAX_BYTES we are back
+ * to batching.
+ */
+#define ECHO_WINDOW_MS 100
+#define ECHO_MAX_BYTES 256
 
-		/* shell called exit() */
-		if (ret < 0 && errno == EIO)
-			exit(0);
+static struct {
+	uint8_t pending:1;
+	uint64_t input_ms;
+	size_t bytes;
+} echo;
+
+static void echo_input(void)
+{
+	echo.pending = 1;
+	echo.input_ms = time_ms();
+	echo.bytes = 0;
+}
+
+/*
+ * Returns non-zero if the data read so far should be rendered immediately.
+ */
+static int echo_fast_path(size_t ret)
+{
+	if (!echo.pending)
+		return 0;
+
+	echo.bytes += ret;
 
-		if (ret > 0)
-			mt_parse(&parser, buf, ret);
+	if (echo.bytes > ECHO_MAX_BYTES) {
+		echo.pending = 0;
+		mt_stat_inc(MT_STAT_ECHO_BULK);
+		return 0;
 	}
 
-	if (damage.scroll)
-		do_scroll(damage.scroll);
+	if (time_ms() - echo.input_ms > ECHO_WINDOW_MS) {
+		echo.pending = 0;
+		return 0;
+	}
 
-	if (damage.s_col >= 0)
-		do_damage();
+	/* Small read, the response is likely complete */
+	return ret < MT_RING_MIN_READ;
 }
 
-static void vt_write(int fd, char *buf, int buf_len)
+/*
+ * Sleeps until the next main loop iteration, while waiting for a response to
+ * input we wake up as soon as the PTY is readable.
+ */
+static void idle_wait(int fd)
 {
-	int ret;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	struct timespec ts = {.tv_nsec = 100000};
 
-	ret = write(fd, buf, buf_len);
-	if (ret < 0)
-		fprintf(stderr, "WRITE %s\n", strerror(errno));
+	if (!echo.pending) {
+		usleep(100);
+		return;
+	}
+
+	ppoll(&pfd, 1, &ts, NULL);
 }
 
-static void vt_putc(int fd, char c)
+static uint64_t time_us(void)
 {
-	vt_write(fd, &c, 1);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void key_to_vt(gp_event *ev, int fd)
+/*
+ * Output scheduling.
+ *
+ * Input events are processed at the start of each main loop iteration, so
+ * parsing is bounded by PARSE_BUDGET_US rather than by a number of reads in
+ * order not to starve the keyboard when the application floods us with
+ * output.
+ *
+ * While flooded we only parse and render at most once per FLOOD_FRAME_MS,
+ * intermediate frames are skipped and the damage accumulates.
+ */
+#define PARSE_BUDGET_US 4000
+#define FLOOD_FRAME_MS 40
+
+static struct {
+	uint64_t frame_ms;
+} sched;
+
+/*
+ * Returns non-zero if the budget ran out before PTY was drained.
+ */
+static int vt_read(int fd)
 {
-	switch (ev->key.key) {
-	case GP_KEY_UP:
-		vt_write(fd, "\eOA", 3);
-	break;
-	case GP_KEY_DOWN:
-		vt_write(fd, "\eOB", 3);
-	break;
-	case GP_KEY_RIGHT:
-		vt_write(fd, "\eOC", 3);
-	break;
-	case GP_KEY_LEFT:
-		vt_write(fd, "\eOD", 3);
-	break;
-	case GP_KEY_DELETE:
-		vt_write(fd, "\e[3~", 4);
-	break;
-	case GP_KEY_PAGE_UP:
-		vt_write(fd, "\e[5~", 4);
-	break;
-	case GP_KEY_PAGE_DOWN:
+	uint64_t deadline = time_us() + PARSE_BUDGET_US;
+	const char *span;
+	ssize_t ret;
+	size_t len;
+
+	for (;;) {
+		if (use_uring)
+			ret = mt_uring_run(&uring, 0);
+		else
+			ret = mt_ring_fill(&input, fd);
+
+		/* shell called exit() */
+		if (ret < 0 && errno == EIO)
+			exit(0);
+
+		if (use_uring && ret < 0 && errno == EOPNOTSUPP) {
+			uring_fallback();
+			continue;
+		}
+
+		if (ret <= 0)
+			return 0;
+
+		latency.response = 1;
+
+		while ((span = mt_ring_span(&input, &len))) {
+			mt_parse(&parser, span, len);
+			mt_ring_consume(&input, len);
+		}
+
+		if (echo_fast_path(ret)) {
+			mt_stat_inc(MT_STAT_ECHO_FRAMES);
+			return 0;
+		}
+
+		/*
+		 * Single io_uring_enter() per main loop iteration, a full read
+		 * means that there is more to parse in the next one.
+		 */
+		if (use_uring)
+			return uring.read_full;
+
+		if (time_us() >= deadline)
+			return 1;
+	}
+}
+
+/*
+ * Everything on the screen scrolled away since the last frame, repaint the
+ * final screen instead of blitting and repainting the damage.
+ */
+static void do_fast_forward(void)
+{
+	uint64_t trace = mt_trace_begin();
+
+	mt_stat_inc(MT_STAT_FF_FRAMES);
+
+	redraw_region(0, rows, 0, cols);
+	backend_flip();
+
+	mt_trace_end(MT_TRACE_DAMAGE, trace, rows * cols);
+}
+
+/*
+ * Returns zero if the frame was skipped.
+ */
+static int vt_render(int flood)
+{
+	uint64_t now;
+	int ff = mt_sbuf_fast_forward(sbuf);
+
+	if (!ff && !damage.scroll && damage.s_col < 0)
+		return 1;
+
+	now = time_ms();
+
+	if (flood && now - sched.frame_ms < FLOOD_FRAME_MS) {
+		mt_stat_inc(MT_STAT_FRAMES_SKIPPED);
+		return 0;
+	}
+
+	sched.frame_ms = now;
+
+	mt_stat_inc(MT_STAT_FRAMES);
+
+	if (ff) {
+		do_fast_forward();
+	} else {
+		if (damage.scroll)
+			do_scroll(damage.scroll);
+
+		if (damage.s_col >= 0)
+			do_damage();
+	}
+
+	mt_damage_reset(&damage);
+	mt_sbuf_frame(sbuf);
+
+	return 1;
+}
+
+static void vt_write(int fd, char *buf, int buf_len)
+{
+	(void)fd;
+
+	paste_cancel();
+
+	latency_key();
+	echo_input();
+
+	pty_write(buf, buf_len);
+}
+
+static void vt_putc(int fd, char c)
+{
+	vt_write(fd, &c, 1);
+}
+
+static void key_to_vt(gp_event *ev, int fd)
+{
+	switch (ev->key.key) {
+	case GP_KEY_UP:
+		vt_write(fd, "\eOA", 3);
+	break;
+	case GP_KEY_DOWN:
+		vt_write(fd, "\eOB", 3);
+	break;
+	case GP_KEY_RIGHT:
+		vt_write(fd, "\eOC", 3);
+	break;
+	case GP_KEY_LEFT:
+		vt_write(fd, "\eOD", 3);
+	break;
+	case GP_KEY_DELETE:
+		vt_write(fd, "\e[3~", 4);
+	break;
+	case GP_KEY_PAGE_UP:
+		vt_write(fd, "\e[5~", 4);
+	break;
+	case GP_KEY_PAGE_DOWN:
 		vt_write(fd, "\e[6~", 4);
 	break;
 	case GP_KEY_HOME:
@@ -335,52 +936,132 @@ static void key_to_vt(gp_event *ev, int fd)
 	}
 }
 
+/*
+ * Shift+Insert requests the clipboard, the data are pasted once the backend
+ * sends GP_EV_SYS_CLIPBOARD.
+ */
+static int paste_key(gp_event *ev)
+{
+	if (ev->key.key != GP_KEY_INSERT)
+		return 0;
+
+	if (!gp_ev_any_key_pressed(ev, GP_KEY_LEFT_SHIFT, GP_KEY_RIGHT_SHIFT))
+		return 0;
+
+	gp_backend_clipboard_request(win);
+
+	return 1;
+}
+
+static void paste_clipboard(void)
+{
+	char *str = gp_backend_clipboard_get(win);
+
+	if (!str)
+		return;
+
+	paste_start(str, strlen(str));
+	free(str);
+}
+
 static void utf_to_vt(gp_event *ev, int fd)
 {
 	int ctrl = gp_ev_any_key_pressed(ev, GP_KEY_RIGHT_CTRL, GP_KEY_LEFT_CTRL);
 
+	if (paste.data && ev->utf.ch == '\e') {
+		paste_cancel();
+		return;
+	}
+
 	vt_putc(fd, ev->utf.ch);
 }
 
 #ifdef MT_RESIZE
-static void resize(int fd, gp_event *ev)
+/*
+ * Resize events are coalesced and the grid is resized at most once per main
+ * loop iteration. The application is notified about the new size only after
+ * it did not change for RESIZE_SETTLE_MS, so that the shell does not get a
+ * SIGWINCH storm while the window is being dragged.
+ */
+#define RESIZE_SETTLE_MS 50
+
+static struct {
+	uint8_t pending:1;
+	uint8_t notify:1;
+	gp_size w, h;
+	uint64_t last;
+} resize_req;
+
+static void resize_event(gp_event *ev)
+{
+	resize_req.w = ev->sys.w;
+	resize_req.h = ev->sys.h;
+	resize_req.pending = 1;
+	resize_req.last = time_ms();
+}
+
+static void resize(int fd)
 {
 	struct winsize w;
 
-	cols = ev->sys.w/cell_w;
-	rows = ev->sys.h/cell_h;
+	if (resize_req.pending) {
+		resize_req.pending = 0;
+
+		gp_backend_resize_ack(win);
+
+		if (resize_req.w/cell_w != (gp_size)cols || resize_req.h/cell_h != (gp_size)rows) {
+			if (!mt_sbuf_resize(parser.sbuf, resize_req.w/cell_w, resize_req.h/cell_h)) {
+				cols = resize_req.w/cell_w;
+				rows = resize_req.h/cell_h;
+				resize_req.notify = 1;
+			}
+		}
+
+		gp_fill(win->pixmap, bg_col(mt_sbuf_cur_char(parser.sbuf)));
+		redraw_region(0, rows, 0, cols);
+		backend_flip();
+
+		mt_damage_reset(&damage);
+		mt_sbuf_frame(parser.sbuf);
+	}
+
+	if (!resize_req.notify || time_ms() - resize_req.last < RESIZE_SETTLE_MS)
+		return;
+
+	resize_req.notify = 0;
 
 	w.ws_col = cols;
 	w.ws_row = rows;
 
 	if (ioctl(fd, TIOCSWINSZ, &w) < 0)
 		fprintf(stderr, "ioctl(fd, TIOCSWINSZ, ...) failed\n");
-
-	gp_backend_resize_ack(win);
-
-	mt_sbuf_resize(parser.sbuf, cols, rows);
-
-	gp_fill(win->pixmap, bg_col(mt_sbuf_cur_char(parser.sbuf)));
-	redraw_region(0, rows, 0, cols);
-	gp_backend_flip(win);
 }
 #endif
 
 #define TERM "/bin/bash"
 
-int run_vt_shell(void)
+/*
+ * Starts a shell in cwd, or in the current directory if cwd is NULL.
+ *
+ * Returns PTY master or -1 on failure.
+ */
+int run_vt_shell(const char *cwd)
 {
 	int fd, pid, flags;
 
 	pid = forkpty(&fd, NULL, NULL, NULL);
 	if (pid < 0) {
-		fprintf(stderr, "Fork failed!\n");
-		exit(1);
+		fprintf(stderr, "Fork failed: %s\n", strerror(errno));
+		return -1;
 	}
 
 	if (pid == 0) {
+		if (cwd && chdir(cwd))
+			fprintf(stderr, "Can't chdir to '%s': %s\n", cwd, strerror(errno));
+
 		putenv("TERM=xterm");
 		execl(TERM, TERM, NULL);
+		_exit(127);
 	}
 
 	flags = fcntl(fd, F_GETFL, 0);
@@ -389,9 +1070,8 @@ int run_vt_shell(void)
 	return fd;
 }
 
-void init_graphics(void)
+void init_fonts(void)
 {
-	gp_size w, h;
 	const gp_font_family *font_family;
 
 	font_family = gp_font_family_lookup("haxor-narrow-18");
@@ -406,11 +1086,16 @@ void init_graphics(void)
 
 	cell_h = gp_font_height(style.font);
 	cell_w = gp_font_max_width(style.font);
+}
+
+void init_graphics(void)
+{
+	gp_size w, h;
 
 	w = cell_w * 80;
 	h = cell_h * 25;
 
-	win = gp_x11_init(NULL, 0, 0, w, h, "term", 0);
+	win = gp_x11_init(NULL, 0, 0, w, h, CAPTION, 0);
 	if (!win) {
 		fprintf(stderr, "Can't initialize backend!\n");
 		exit(1);
@@ -428,30 +1113,192 @@ void init_graphics(void)
 	gp_backend_flip(win);
 }
 
-static void writefd(int fd, const char *str)
+static void writefd(void *priv, const char *str)
 {
-	write(fd, str, strlen(str));
+	(void)priv;
+
+	pty_write(str, strlen(str));
 }
 
-static void bell(void)
+static void bell(void *priv)
 {
+	(void)priv;
+
 	printf("Bell\n");
 }
 
-int main(void)
+/*
+ * Statistics and latency histogram are printed to stderr on SIGUSR1.
+ */
+static volatile sig_atomic_t stats_req;
+
+static void stats_signal(int sig)
+{
+	(void)sig;
+	stats_req = 1;
+}
+
+static void stats_dump(void)
+{
+	if (!stats_req)
+		return;
+
+	stats_req = 0;
+	mt_stats_dump(&mt_stats, stderr);
+
+	if (latency.enabled)
+		mt_latency_dump(&latency.hist, stderr);
+}
+
+/*
+ * If MTERM_TRACE is set to a file name, phases are traced and written into
+ * the file as Chrome trace JSON on SIGUSR2.
+ */
+static const char *trace_path;
+static volatile sig_atomic_t trace_req;
+
+static void trace_signal(int sig)
+{
+	(void)sig;
+	trace_req = 1;
+}
+
+static void trace_init(void)
+{
+	trace_path = getenv("MTERM_TRACE");
+	if (!trace_path)
+		return;
+
+	mt_trace_enable();
+	signal(SIGUSR2, trace_signal);
+}
+
+static void trace_dump(void)
+{
+	FILE *f;
+
+	if (!trace_req)
+		return;
+
+	trace_req = 0;
+
+	f = fopen(trace_path, "w");
+	if (!f) {
+		fprintf(stderr, "Can't open '%s': %s\n", trace_path, strerror(errno));
+		return;
+	}
+
+	if (mt_trace_dump(f) | fclose(f))
+		fprintf(stderr, "Failed to write '%s'\n", trace_path);
+}
+
+/*
+ * If MTERM_MIRROR is set to a socket path, screen deltas are served to
+ * clients connected to the socket.
+ */
+static struct mt_mirror mirror;
+static int use_mirror;
+
+static void mirror_init(void)
+{
+	const char *path = getenv("MTERM_MIRROR");
+
+	if (!path)
+		return;
+
+	if (mt_mirror_init(&mirror, sbuf, path)) {
+		fprintf(stderr, "Can't create mirror socket '%s': %s\n", path, strerror(errno));
+		return;
+	}
+
+	/* Disconnected clients are handled by write() errors */
+	signal(SIGPIPE, SIG_IGN);
+	use_mirror = 1;
+}
+
+static void mirror_run(void)
+{
+	if (use_mirror)
+		mt_mirror_run(&mirror);
+}
+
+/*
+ * If MTERM_SHM is set the grid is exported to a shared memory object of that
+ * name, e.g. MTERM_SHM=/mterm, see mt-shm.h.
+ */
+static void shm_init(void)
+{
+	const char *name = getenv("MTERM_SHM");
+
+	if (!name)
+		return;
+
+	if (mt_shm_export(sbuf, name))
+		fprintf(stderr, "Can't export grid to '%s': %s\n", name, strerror(errno));
+}
+
+/*
+ * MTERM_HIST_LINES sets the number of history lines, with MTERM_HIST_SPILL
+ * set to a number of MB the history over that is moved into a temporary file
+ * in $TMPDIR.
+ */
+static void hist_init(void)
+{
+	const char *lines = getenv("MTERM_HIST_LINES");
+	const char *spill = getenv("MTERM_HIST_SPILL");
+	const char *dir = getenv("TMPDIR");
+
+	if (lines)
+		mt_hist_set_limit(&sbuf->hist, strtoul(lines, NULL, 0));
+
+	if (!spill)
+		return;
+
+	if (!dir)
+		dir = "/tmp";
+
+	if (mt_hist_set_spill(&sbuf->hist, dir, strtoul(spill, NULL, 0) << 20))
+		fprintf(stderr, "Can't spill history to '%s': %s\n", dir, strerror(errno));
+}
+
+/*
+ * Runs a terminal window on a PTY master, when notify_fd is not -1 a line is
+ * written into it once the window is up and the fd is closed. If the client
+ * gave up waiting it opened a window on its own, so this one is closed.
+ */
+static int run_window(int fd, int notify_fd)
 {
 	gp_event *ev;
-	int fd;
+	int flood;
 
-	fd = run_vt_shell();
 	init_mterm();
 
-	parser.response_fd = fd;
+	if (!getenv("MTERM_NO_URING"))
+		use_uring = !mt_uring_init(&uring, fd, &input);
+
 	parser.response = writefd;
 	parser.bell = bell;
 
 	init_graphics();
 
+	if (notify_fd >= 0) {
+		if (write(notify_fd, "ok\n", 3) != 3) {
+			fprintf(stderr, "Can't notify client: %s\n", strerror(errno));
+			gp_backend_exit(win);
+			return 1;
+		}
+
+		close(notify_fd);
+	}
+
+	signal(SIGUSR1, stats_signal);
+	trace_init();
+	mirror_init();
+	shm_init();
+	hist_init();
+
+	latency.enabled = !!getenv("MTERM_LATENCY");
+
 	for (;;) {
 		while ((ev = gp_backend_poll_event(win))) {
 			gp_ev_dump(ev);
@@ -460,24 +1307,356 @@ int main(void)
 				utf_to_vt(ev, fd);
 			break;
 			case GP_EV_KEY:
-				if (ev->code == GP_EV_KEY_DOWN)
+				if (ev->code == GP_EV_KEY_DOWN && !paste_key(ev))
 					key_to_vt(ev, fd);
 			break;
-#ifdef MT_RESIZE
 			case GP_EV_SYS:
-				if (ev->code == GP_EV_SYS_RESIZE)
-					resize(fd, ev);
-			break;
+				switch (ev->code) {
+#ifdef MT_RESIZE
+				case GP_EV_SYS_RESIZE:
+					resize_event(ev);
+				break;
 #endif
+				case GP_EV_SYS_CLIPBOARD:
+					paste_clipboard();
+				break;
+				}
+			break;
 			}
 		}
 
-		vt_read(fd);
+#ifdef MT_RESIZE
+		resize(fd);
+#endif
 
-		usleep(100);
+		paste_step();
+		pty_flush(fd);
+
+		flood = vt_read(fd);
+
+		/* Must run before the frame ends fast-forward mode */
+		mirror_run();
+
+		if (vt_render(flood))
+			update_flush();
+
+		mt_diag_dump(&parser.diag, stderr, 0);
+		stats_dump();
+		trace_dump();
+
+		if (!flood)
+			idle_wait(fd);
 	}
 
 out:
 	gp_backend_exit(win);
 	return 0;
 }
+
+/*
+ * With --server the fonts are looked up once and shells are forked in
+ * advance, mterm started without arguments asks the server over a Unix socket
+ * to open a window and exits.
+ *
+ * Each window is a child forked from the server, so it starts with the fonts
+ * already loaded and takes a running shell from the pool. The backend is not
+ * kept warm, it's initialized in each window since a display connection can't
+ * be shared between processes.
+ *
+ * The socket is $XDG_RUNTIME_DIR/mterm.sock or /tmp/mterm-$UID/mterm.sock,
+ * the directory has to be owned by the user and not accessible by anybody
+ * else and both sides check that the peer runs under the same user. A client
+ * sends its DISPLAY and working directory, each terminated by a newline, and
+ * the server answers once the window is up, a client that does not get the answer in REQ_TIMEOUT_MS opens
+ * a window on its own.
+ *
+ * Shells from the pool run in the directory the server was started in, a
+ * client with a different working directory gets a newly forked shell. The
+ * environment is not forwarded, shells inherit the environment of the server
+ * and only DISPLAY is passed to the window.
+ *
+ * MTERM_POOL sets the number of shells forked in advance,
+ * MTERM_NO_SERVER disables the client.
+ */
+#define POOL_SIZE 2
+#define REQ_TIMEOUT_MS 1000
+
+static int dir_private(const char *dir)
+{
+	struct stat st;
+
+	if (lstat(dir, &st))
+		return 0;
+
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		errno = EPERM;
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns zero on success, non-zero on failure with errno set.
+ */
+static int server_path(char *path, size_t size, int create)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char tmp[64];
+	int ret;
+
+	if (!dir) {
+		snprintf(tmp, sizeof(tmp), "/tmp/mterm-%u", (unsigned int)getuid());
+		dir = tmp;
+
+		if (create && mkdir(dir, 0700) && errno != EEXIST)
+			return 1;
+	}
+
+	if (!dir_private(dir))
+		return 1;
+
+	ret = snprintf(path, size, "%s/mterm.sock", dir);
+	if (ret < 0 || (size_t)ret >= size) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int peer_is_user(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+
+	return cred.uid == getuid();
+}
+
+static int client_open(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct timeval tv = {.tv_sec = REQ_TIMEOUT_MS / 1000};
+	const char *display = getenv("DISPLAY");
+	char buf[16], cwd[PATH_MAX];
+	ssize_t ret;
+	int fd;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		cwd[0] = 0;
+
+	if (server_path(addr.sun_path, sizeof(addr.sun_path), 0))
+		return 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 1;
+
+	/* The window may hang in the backend initialization */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) || !peer_is_user(fd) ||
+	    dprintf(fd, "%s\n%s\n", display ? display : "", cwd) < 0) {
+		close(fd);
+		return 1;
+	}
+
+	ret = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	return ret < 3 || memcmp(buf, "ok\n", 3);
+}
+
+static volatile sig_atomic_t child_exited;
+
+static void child_signal(int sig)
+{
+	(void)sig;
+	child_exited = 1;
+}
+
+static void server_reap(struct mt_pool *pool)
+{
+	pid_t pid;
+
+	child_exited = 0;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		mt_pool_reap(pool, pid);
+}
+
+/*
+ * Reads the request, on success req is the DISPLAY and cwd points to the
+ * working directory in the same buffer.
+ */
+static int server_req(int cfd, char *req, size_t size, char **cwd)
+{
+	struct timeval tv = {.tv_sec = REQ_TIMEOUT_MS / 1000};
+	size_t len = 0;
+	ssize_t ret;
+	char *nl;
+
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	for (;;) {
+		ret = read(cfd, req + len, size - len - 1);
+		if (ret <= 0)
+			return 1;
+
+		len += ret;
+		req[len] = 0;
+
+		nl = strchr(req, '\n');
+		if (nl && strchr(nl + 1, '\n')) {
+			*nl = 0;
+			*cwd = nl + 1;
+			(*cwd)[strcspn(*cwd, "\n")] = 0;
+			return 0;
+		}
+
+		if (len + 1 >= size)
+			return 1;
+	}
+}
+
+static int same_dir(const char *cwd)
+{
+	char dir[PATH_MAX];
+
+	return !cwd[0] || (getcwd(dir, sizeof(dir)) && !strcmp(dir, cwd));
+}
+
+static void server_open(struct mt_pool *pool, int sfd, int cfd)
+{
+	char display[256 + PATH_MAX], *cwd;
+	pid_t pid, shell;
+	int fd = -1;
+
+	if (server_req(cfd, display, sizeof(display), &cwd))
+		return;
+
+	if (same_dir(cwd))
+		fd = mt_pool_get(pool, &shell);
+
+	if (fd < 0)
+		fd = run_vt_shell(cwd[0] ? cwd : NULL);
+
+	if (fd < 0)
+		goto err;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Fork failed: %s\n", strerror(errno));
+		close(fd);
+		goto err;
+	}
+
+	if (pid == 0) {
+		signal(SIGCHLD, SIG_DFL);
+		close(sfd);
+		mt_pool_close(pool);
+
+		if (display[0])
+			setenv("DISPLAY", display, 1);
+
+		exit(run_window(fd, cfd));
+	}
+
+	close(fd);
+
+	if (mt_pool_fill(pool))
+		fprintf(stderr, "Can't fork shell: %s\n", strerror(errno));
+
+	return;
+err:
+	if (write(cfd, "err\n", 4) != 4)
+		fprintf(stderr, "Can't reply to client: %s\n", strerror(errno));
+}
+
+static int run_server(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct sigaction sa = {.sa_handler = child_signal};
+	const char *size = getenv("MTERM_POOL");
+	struct mt_pool pool;
+	mode_t umask_old;
+	int sfd, cfd, ret;
+
+	if (server_path(addr.sun_path, sizeof(addr.sun_path), 1)) {
+		fprintf(stderr, "Can't use socket directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	init_fonts();
+
+	/* No SA_RESTART so that accept() returns on SIGCHLD */
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	mt_pool_init(&pool, TERM, size ? strtoul(size, NULL, 0) : POOL_SIZE, cols, rows);
+
+	if (mt_pool_fill(&pool))
+		fprintf(stderr, "Can't fork shell: %s\n", strerror(errno));
+
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0) {
+		fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	unlink(addr.sun_path);
+
+	umask_old = umask(077);
+	ret = bind(sfd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(umask_old);
+
+	if (ret || listen(sfd, 16)) {
+		fprintf(stderr, "Can't listen on '%s': %s\n", addr.sun_path, strerror(errno));
+		return 1;
+	}
+
+	for (;;) {
+		if (child_exited) {
+			server_reap(&pool);
+
+			if (mt_pool_fill(&pool))
+				fprintf(stderr, "Can't fork shell: %s\n", strerror(errno));
+		}
+
+		cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno != EINTR)
+				fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+			continue;
+		}
+
+		if (peer_is_user(cfd))
+			server_open(&pool, sfd, cfd);
+
+		close(cfd);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+
+	if (argc > 1 && !strcmp(argv[1], "--server"))
+		return run_server();
+
+	if (!getenv("MTERM_NO_SERVER") && !client_open())
+		return 0;
+
+	fd = run_vt_shell(NULL);
+	if (fd < 0)
+		return 1;
+
+	init_fonts();
+
+	return run_window(fd, -1);
+}